@@ -1,187 +1,2222 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
 
 #include "charconverters.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CharConvertersSSE2
+#include <emmintrin.h>
+#endif
+
+// SSSE3 adds pshufb, a byte shuffle driven by a register; it needs -mssse3 or newer (or /arch:AVX)
+#if defined(__SSSE3__) || defined(__AVX__)
+#define CharConvertersSSSE3
+#include <tmmintrin.h>
+#endif
+
 namespace CharConverters
 {
-    std::u8string WideStrToUTF8(const std::wstring_view in) {
-        std::u8string out;
-        // Preallocate memory for the "out" string to reduce the number of reallocations
-        out.reserve(in.size() * 4);
-        uint32_t codePoint = 0;
-        for (size_t i = 0; i < in.size(); ++i) {
-            wchar_t wchar = in[i];
-            /*
-            * +--------------+--------------+----------+----------+----------+----------+
-            * | Code point   | Code point   | Byte 1   | Byte 2   | Byte 3   | Byte 4   |
-            * | (First)      | (Last)       |          |          |          |          |
-            * +--------------+--------------+----------+----------+----------+----------+
-            * | U+0000       | U+007F       | 0xxxxxxx |          |          |          |
-            * | U+0080       | U+07FF       | 110xxxxx | 10xxxxxx |          |          |
-            * | U+0800       | U+FFFF       | 1110xxxx | 10xxxxxx | 10xxxxxx |          |
-            * | U+10000      | U+10FFFF     | 11110xxx | 10xxxxxx | 10xxxxxx | 10xxxxxx |
-            * +--------------+--------------+----------+----------+----------+----------+
-            */
-            // Single-byte character
-            if (wchar <= 0x7F) {
-                out.push_back(static_cast<char8_t>(wchar));
+    namespace
+    {
+        /*
+        * Worst case output sizes, so the result is allocated once and then written through a raw pointer.
+        * A UTF-16 unit gives at most 3 bytes (a surrogate pair gives 4 bytes for 2 units),
+        * a UTF-32 unit gives at most 4 bytes.
+        * A UTF-8 byte gives at most one code unit (4 bytes give 2 UTF-16 units or 1 UTF-32 unit),
+        * plus one unit of slack for the store DecodeUTF8 makes past the last character
+        */
+#ifdef WideCharIsUTF16
+        constexpr size_t maxUTF8BytesPerUnit = 3;
+#else
+        constexpr size_t maxUTF8BytesPerUnit = 4;
+#endif
+
+        constexpr size_t MaxUTF8Units(size_t wideUnits) {
+            return wideUnits * maxUTF8BytesPerUnit;
+        }
+
+        constexpr size_t MaxWideUnits(size_t utf8Units) {
+            return utf8Units + 1;
+        }
+
+        /*
+        * Sizes "out" to "maxSize" without initializing it, lets "kernel" write through a raw pointer
+        * and trims the string to the length the kernel returned.
+        * resize_and_overwrite must not be left with an exception, that's why kernels report errors
+        * through an out parameter and the caller throws after the string is in a valid state
+        */
+        template<typename String, typename Kernel>
+        void ResizeAndOverwrite(String& out, size_t maxSize, Kernel kernel) {
+#ifdef __cpp_lib_string_resize_and_overwrite
+            out.resize_and_overwrite(maxSize, [&](typename String::value_type* data, size_t) {
+                return kernel(data);
+            });
+#else
+            out.resize(maxSize);
+            out.resize(kernel(out.data()));
+#endif
+        }
+
+        /*
+        * SWAR (SIMD within a register) helpers for ASCII runs. They need nothing but 64-bit integers,
+        * so they work on every target. Eight UTF-8 bytes are tested with one mask: a byte is ASCII
+        * if its top bit is zero. Wide units are packed and unpacked with shifts and masks,
+        * which assumes little-endian byte order; on other targets only the scalar tails run.
+        * memcpy keeps the unaligned loads and stores well-defined, compilers turn it into a single move
+        */
+        constexpr bool swarEnabled = std::endian::native == std::endian::little;
+
+        inline uint64_t LoadWord(const void* in) {
+            uint64_t word;
+            std::memcpy(&word, in, sizeof(word));
+            return word;
+        }
+
+        inline void StoreWord(void* out, uint64_t word) {
+            std::memcpy(out, &word, sizeof(word));
+        }
+
+        // Widens 8 bytes packed in "word" to 16 or 32-bit units
+        template<typename Unit>
+        inline void StoreWidened8(uint64_t word, Unit* out) {
+            if constexpr (sizeof(Unit) == 2) {
+                // Every byte of 4 goes to the bottom of its own 16-bit lane
+                for (size_t half = 0; half < 8; half += 4) {
+                    const uint64_t bytes = (word >> (half * 8)) & 0xFFFFFFFF;
+                    StoreWord(out + half, (bytes & 0xFF) | ((bytes & 0xFF00) << 8) | ((bytes & 0xFF0000) << 16) | ((bytes & 0xFF000000) << 24));
+                }
             }
-            // Two-byte character
-            else if (wchar <= 0x07FF) {
-                /*
-                * For example, let's take the character 0000001110100110 (0x03A6) and
-                * convert it to 11001110 10100110 (0xCE 0xA6)
-                * First byte:
-                * 1. Shift right by 6: 00001110
-                * 2. Add 11000000: 11001110 -- this gives us the first byte
-                * Second byte:
-                * 1. Apply a mask 00111111 (0x3F) to 10100110 (first 8 bits of 0x03A6): 00100110
-                * 2. Add 10000000 (0x80): 10100110
-                */
-                out.push_back(static_cast<char8_t>((wchar >> 6) | 0xC0));
-                out.push_back(static_cast<char8_t>((wchar & 0x3F) | 0x80));
+            else {
+                // Every byte of 2 goes to the bottom of its own 32-bit lane
+                for (size_t quarter = 0; quarter < 8; quarter += 2) {
+                    const uint64_t bytes = (word >> (quarter * 8)) & 0xFFFF;
+                    StoreWord(out + quarter, (bytes & 0xFF) | ((bytes & 0xFF00) << 24));
+                }
+            }
+        }
+
+#ifdef CharConvertersSSE2
+        /*
+        * SSE2 versions of the same helpers, 16 bytes per step.
+        * SSE2 is part of every x86-64 CPU, so these are used there without any build flags
+        */
+        inline __m128i Load128(const void* in) {
+            return _mm_loadu_si128(static_cast<const __m128i*>(in));
+        }
+
+        inline void Store128(void* out, __m128i value) {
+            _mm_storeu_si128(static_cast<__m128i*>(out), value);
+        }
+
+        // Loads 8 bytes into the lower half
+        inline __m128i Load64(const void* in) {
+            return _mm_loadl_epi64(static_cast<const __m128i*>(in));
+        }
+
+        // Stores the lower 8 bytes
+        inline void Store64(void* out, __m128i value) {
+            _mm_storel_epi64(static_cast<__m128i*>(out), value);
+        }
+
+        // Widens 16 bytes to 16 or 32-bit units by interleaving them with zeros
+        template<typename Unit>
+        inline void StoreWidened16(__m128i bytes, Unit* out) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            if constexpr (sizeof(Unit) == 2) {
+                Store128(out, low);
+                Store128(out + 8, high);
+            }
+            else {
+                Store128(out, _mm_unpacklo_epi16(low, zero));
+                Store128(out + 4, _mm_unpackhi_epi16(low, zero));
+                Store128(out + 8, _mm_unpacklo_epi16(high, zero));
+                Store128(out + 12, _mm_unpackhi_epi16(high, zero));
+            }
+        }
+#endif
+
+        // Widens the ASCII run at the start of "in" to 16 or 32-bit units, returns its length
+        template<typename Byte, typename Unit>
+        size_t WidenASCII(const Byte* in, size_t size, Unit* out) {
+            size_t i = 0;
+#ifdef CharConvertersSSE2
+            for (; i + 16 <= size; i += 16) {
+                const __m128i bytes = Load128(in + i);
+                // movemask gathers the top bit of every byte, zero means all 16 are ASCII
+                if (_mm_movemask_epi8(bytes) != 0) {
+                    break;
+                }
+                StoreWidened16(bytes, out + i);
+            }
+#endif
+            if constexpr (swarEnabled) {
+                for (; i + 8 <= size; i += 8) {
+                    const uint64_t word = LoadWord(in + i);
+                    if ((word & 0x8080808080808080) != 0) {
+                        break;
+                    }
+                    StoreWidened8(word, out + i);
+                }
+            }
+            for (; i < size && static_cast<unsigned char>(in[i]) < 0x80; ++i) {
+                out[i] = static_cast<Unit>(static_cast<unsigned char>(in[i]));
+            }
+            return i;
+        }
+
+#ifdef CharConvertersSSE2
+        /*
+        * WidenASCII for input followed by padding: the last bytes get a full load too,
+        * with the lanes past the end counted as non-ASCII. Every step stores 16 units
+        */
+        template<typename Unit>
+        size_t WidenASCIIPadded(const char8_t* in, size_t size, Unit* out) {
+            size_t i = 0;
+            while (i < size) {
+                const __m128i bytes = Load128(in + i);
+                const unsigned past = size - i < 16 ? 0xFFFFu << (size - i) : 0;
+                const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(bytes)) | past | 0x10000;
+                StoreWidened16(bytes, out + i);
+                const size_t ascii = std::countr_zero(mask);
+                i += ascii;
+                if (ascii < 16) {
+                    break;
+                }
+            }
+            return i;
+        }
+#endif
+
+        // Length of the ASCII run at the start of "in"
+        template<typename Byte>
+        size_t ASCIIPrefixLength(const Byte* in, size_t size) {
+            size_t i = 0;
+#ifdef CharConvertersSSE2
+            for (; i + 16 <= size; i += 16) {
+                const int mask = _mm_movemask_epi8(Load128(in + i));
+                if (mask != 0) {
+                    return i + std::countr_zero(static_cast<unsigned>(mask));
+                }
+            }
+#endif
+            if constexpr (swarEnabled) {
+                for (; i + 8 <= size; i += 8) {
+                    const uint64_t word = LoadWord(in + i) & 0x8080808080808080;
+                    if (word != 0) {
+                        return i + std::countr_zero(word) / 8;
+                    }
+                }
             }
-            // On Windows, wchar_t is 16 bits, while on Linux, it's 32 bits
+            while (i < size && static_cast<unsigned char>(in[i]) < 0x80) {
+                ++i;
+            }
+            return i;
+        }
+
+        // Widens every byte of "in" to a 16 or 32-bit unit, Latin-1 maps straight onto the first 256 code points
+        template<typename Unit>
+        void WidenBytes(const unsigned char* in, size_t size, Unit* out) {
+            size_t i = 0;
+#ifdef CharConvertersSSE2
+            for (; i + 16 <= size; i += 16) {
+                StoreWidened16(Load128(in + i), out + i);
+            }
+#endif
+            if constexpr (swarEnabled) {
+                for (; i + 8 <= size; i += 8) {
+                    StoreWidened8(LoadWord(in + i), out + i);
+                }
+            }
+            for (; i < size; ++i) {
+                out[i] = static_cast<Unit>(in[i]);
+            }
+        }
+
+        // Narrows the ASCII run at the start of "in", 4 units per step, returns its length
+        template<typename Byte>
+        size_t NarrowASCII(const wchar_t* in, size_t size, Byte* out) {
+            size_t i = 0;
+            if constexpr (swarEnabled) {
+                for (; i + 4 <= size; i += 4) {
 #ifdef WideCharIsUTF16
-            /*
-            * All according to the formula from https://en.wikipedia.org/wiki/UTF-16#Examples
-            * For example, let's consider 0xD801 0xDC37
-            * For the high surrogate:
-            * 1. Subtract 0xD800 from the high surrogate 0xD801: (0x0001)
-            * 2. Multiply by 0x400: 0x0001 * 0x400 == 0x0400
-            * For the low surrogate:
-            * 1. Subtract 0xDC00 from the low surrogate 0xDC37: 00110111 (0x37)
-            * Final step:
-            * 1. Add the obtained results: 0x0400 + 0x37 == 0x0437
-            * 2. Add 0x10000: 0x0437 + 0x10437
-            * Voilà! We have a UTF-32 character, which can now be converted to UTF-8 (see ConvertUTF8ToWideString)!
-            */
-            // Surrogates for four-byte characters
-            // High surrogate: U+D800 - U+DBFF
-            // Low surrogate: U+DC00 - U+DFFF
-            else if (wchar >= 0xD800 && wchar <= 0xDBFF) {
-                codePoint = ((wchar - 0xD800) * 0x400);
+                    // 4 units in one word, each of them must fit in 7 bits
+                    const uint64_t word = LoadWord(in + i);
+                    if ((word & 0xFF80FF80FF80FF80) != 0) {
+                        break;
+                    }
+                    const uint64_t packed = (word & 0xFF) | ((word >> 8) & 0xFF00) | ((word >> 16) & 0xFF0000) | ((word >> 24) & 0xFF000000);
+#else
+                    // 2 units per word
+                    const uint64_t low = LoadWord(in + i);
+                    const uint64_t high = LoadWord(in + i + 2);
+                    if (((low | high) & 0xFFFFFF80FFFFFF80) != 0) {
+                        break;
+                    }
+                    const uint64_t packed = (low & 0xFF) | ((low >> 24) & 0xFF00) | ((high & 0xFF) << 16) | ((high >> 8) & 0xFF000000);
+#endif
+                    const uint32_t bytes = static_cast<uint32_t>(packed);
+                    std::memcpy(out + i, &bytes, sizeof(bytes));
+                }
+            }
+            for (; i < size && static_cast<uint32_t>(in[i]) < 0x80; ++i) {
+                out[i] = static_cast<Byte>(in[i]);
             }
-            else if (wchar >= 0xDC00 && wchar <= 0xDFFF) {
-                if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
-                    throw std::invalid_argument("Invalid UTF-16 sequence: unexpected low surrogate");
+            return i;
+        }
+
+        /*
+        * Table driven UTF-8 decoder, a DFA as described by Bjoern Hoehrmann
+        * (https://bjoern.hoehrmann.de/utf-8/decoder/dfa/).
+        * The first 256 entries map every byte to one of 12 character classes,
+        * the other 108 are the transitions: utf8DFA[256 + state + class] is the next state.
+        * States are already multiplied by 12, so a transition is a single lookup.
+        * The table rejects everything the standard forbids: overlong forms, surrogates,
+        * code points above U+10FFFF, stray continuation bytes and truncated sequences.
+        * Once the decoder gets into utf8Reject, it stays there
+        */
+        constexpr uint8_t utf8Accept = 0;
+        constexpr uint8_t utf8Reject = 12;
+
+        constexpr uint8_t utf8DFA[364] = {
+            // Character classes for 0x00..0x7F
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            // Character classes for 0x80..0xFF
+            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            8, 8, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            10, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 3, 3, 11, 6, 6, 6, 5, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+            // Transitions
+            0, 12, 24, 36, 60, 96, 84, 12, 12, 12, 48, 72, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+            12, 0, 12, 12, 12, 12, 12, 0, 12, 0, 12, 12, 12, 24, 12, 12, 12, 12, 12, 24, 12, 24, 12, 12,
+            12, 12, 12, 12, 12, 12, 12, 24, 12, 12, 12, 12, 12, 24, 12, 12, 12, 12, 12, 12, 12, 24, 12, 12,
+            12, 12, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12, 12, 36, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12,
+            12, 36, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+        };
+
+        /*
+        * One step of the DFA: moves "state" on by "byte" and returns the updated code point.
+        * For a lead byte the class also tells how many of its bits are payload:
+        * 0xFF >> class leaves 7 bits for ASCII, 5 for 110xxxxx, 4 for 1110xxxx and 3 for 11110xxx.
+        * Every continuation byte shifts the code point by 6 and adds its lower 6 bits
+        */
+        inline uint32_t DecodeStep(uint32_t& state, uint32_t codePoint, uint32_t byte) {
+            const uint32_t type = utf8DFA[byte];
+            codePoint = state != utf8Accept ? (byte & 0x3F) | (codePoint << 6) : (0xFF >> type) & byte;
+            state = utf8DFA[256 + state + type];
+            return codePoint;
+        }
+
+#ifdef CharConvertersSSE2
+        /*
+        * Decodes a run of four-byte sequences, 16 bytes per step, each 32-bit lane holding one sequence
+        * with the lead byte at the bottom. The lanes are checked against 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
+        * and the range U+10000..U+10FFFF, which rules out overlong forms. The run ends at the first step
+        * that isn't four such sequences, returns the number of bytes decoded and moves "written" on
+        */
+        template<typename Unit>
+        size_t DecodeFourByteSequences(const char8_t* in, size_t size, Unit* out, size_t& written) {
+            const __m128i continuation = _mm_set1_epi32(0x3F);
+            size_t i = 0;
+            for (; i + 16 <= size; i += 16) {
+                const __m128i bytes = Load128(in + i);
+                const __m128i pattern = _mm_cmpeq_epi32(_mm_and_si128(bytes, _mm_set1_epi32(static_cast<int>(0xC0C0C0F8))), _mm_set1_epi32(static_cast<int>(0x808080F0)));
+                const __m128i codePoints = _mm_or_si128(
+                    _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bytes, _mm_set1_epi32(0x07)), 18), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(bytes, 8), continuation), 12)),
+                    _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(bytes, 16), continuation), 6), _mm_and_si128(_mm_srli_epi32(bytes, 24), continuation)));
+                const __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(codePoints, _mm_set1_epi32(0xFFFF)), _mm_cmpgt_epi32(_mm_set1_epi32(0x110000), codePoints));
+                if (_mm_movemask_epi8(_mm_and_si128(pattern, inRange)) != 0xFFFF) {
+                    break;
                 }
-                codePoint += (wchar - 0xDC00);
-                codePoint += 0x10000;
-                if (codePoint > 0x10FFFF) {
-                    throw std::invalid_argument("Invalid UTF-16 sequence: low surrogate is out of range");
+                if constexpr (sizeof(Unit) == 2) {
+                    // The surrogates of every code point go to the two halves of its lane, the high one first
+                    const __m128i offset = _mm_sub_epi32(codePoints, _mm_set1_epi32(0x10000));
+                    const __m128i high = _mm_add_epi32(_mm_srli_epi32(offset, 10), _mm_set1_epi32(0xD800));
+                    const __m128i low = _mm_add_epi32(_mm_and_si128(offset, _mm_set1_epi32(0x3FF)), _mm_set1_epi32(0xDC00));
+                    Store128(out + written, _mm_or_si128(high, _mm_slli_epi32(low, 16)));
+                    written += 8;
+                }
+                else {
+                    Store128(out + written, codePoints);
+                    written += 4;
                 }
-                out.push_back(static_cast<char8_t>((codePoint >> 18) | 0xF0));
-                out.push_back(static_cast<char8_t>(((codePoint >> 12) & 0x3F) | 0x80));
-                out.push_back(static_cast<char8_t>(((codePoint >> 6) & 0x3F) | 0x80));
-                out.push_back(static_cast<char8_t>((codePoint & 0x3F) | 0x80));
             }
+            return i;
+        }
+
+        /*
+        * Encodes a run of supplementary characters, 16 bytes of input per step: four surrogate pairs
+        * or four UTF-32 code points, each of them becoming the four bytes of its 32-bit lane.
+        * The run ends at the first step that isn't four valid characters, returns the number of units encoded
+        */
+        size_t EncodeSupplementary(const wchar_t* in, size_t size, char8_t* out) {
+            constexpr size_t step = 16 / sizeof(wchar_t);
+            const __m128i continuation = _mm_set1_epi32(0x3F);
+            const __m128i marker = _mm_set1_epi32(0x80);
+            size_t i = 0;
+            for (; i + step <= size; i += step, out += 16) {
+                const __m128i units = Load128(in + i);
+#ifdef WideCharIsUTF16
+                // The high surrogate in the lower half of every lane, the low surrogate in the upper one
+                const __m128i pattern = _mm_cmpeq_epi32(_mm_and_si128(units, _mm_set1_epi32(static_cast<int>(0xFC00FC00))), _mm_set1_epi32(static_cast<int>(0xDC00D800)));
+                if (_mm_movemask_epi8(pattern) != 0xFFFF) {
+                    break;
+                }
+                const __m128i high = _mm_and_si128(units, _mm_set1_epi32(0x3FF));
+                const __m128i low = _mm_and_si128(_mm_srli_epi32(units, 16), _mm_set1_epi32(0x3FF));
+                const __m128i codePoints = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(high, 10), low), _mm_set1_epi32(0x10000));
+#else
+                const __m128i codePoints = units;
+                const __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(codePoints, _mm_set1_epi32(0xFFFF)), _mm_cmpgt_epi32(_mm_set1_epi32(0x110000), codePoints));
+                if (_mm_movemask_epi8(inRange) != 0xFFFF) {
+                    break;
+                }
 #endif
-            /*
-            * Exactly the same as for two-byte characters,
-            * with an additional byte taken into account
-            */
-            // Three-byte characters
+                const __m128i lead = _mm_or_si128(_mm_srli_epi32(codePoints, 18), _mm_set1_epi32(0xF0));
+                const __m128i second = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(codePoints, 12), continuation), marker);
+                const __m128i third = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(codePoints, 6), continuation), marker);
+                const __m128i fourth = _mm_or_si128(_mm_and_si128(codePoints, continuation), marker);
+                Store128(out, _mm_or_si128(_mm_or_si128(lead, _mm_slli_epi32(second, 8)), _mm_or_si128(_mm_slli_epi32(third, 16), _mm_slli_epi32(fourth, 24))));
+            }
+            return i;
+        }
+#endif
+
+#ifdef CharConvertersSSSE3
+        /*
+        * pshufb tables that squeeze out the unused bytes of 8 16-bit lanes, indexed by an 8-bit lane mask.
+        * In the unit table a set bit drops the whole lane, in the byte table it drops the lane's upper byte.
+        * -1 makes pshufb write a zero
+        */
+        using ShuffleTable = std::array<std::array<int8_t, 16>, 256>;
+
+        constexpr ShuffleTable MakeShuffleTable(bool dropLanes) {
+            ShuffleTable table{};
+            for (size_t mask = 0; mask < table.size(); ++mask) {
+                table[mask].fill(-1);
+                size_t j = 0;
+                for (size_t lane = 0; lane < 8; ++lane) {
+                    const bool set = (mask >> lane) & 1;
+                    if (dropLanes && set) {
+                        continue;
+                    }
+                    table[mask][j++] = static_cast<int8_t>(lane * 2);
+                    if (dropLanes || !set) {
+                        table[mask][j++] = static_cast<int8_t>(lane * 2 + 1);
+                    }
+                }
+            }
+            return table;
+        }
+
+        alignas(16) constexpr ShuffleTable dropUnits = MakeShuffleTable(true);
+        alignas(16) constexpr ShuffleTable dropUpperBytes = MakeShuffleTable(false);
+
+        /*
+        * Decodes 16 bytes if they are eight two-byte sequences, each of them in its own 16-bit lane
+        * with the lead byte at the bottom. Returns the number of units written, 8 or 0
+        */
+        template<typename Unit>
+        size_t DecodeTwoByteVector(const char8_t* in, Unit* out) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i lanes = Load128(in);
+            // 110xxxxx 10xxxxxx, and not 0xC0 or 0xC1, which would be overlong forms of ASCII
+            const __m128i pattern = _mm_cmpeq_epi16(_mm_and_si128(lanes, _mm_set1_epi16(static_cast<short>(0xC0E0))), _mm_set1_epi16(static_cast<short>(0x80C0)));
+            const __m128i overlong = _mm_cmpeq_epi16(_mm_and_si128(lanes, _mm_set1_epi16(0x1E)), zero);
+            if (_mm_movemask_epi8(_mm_andnot_si128(overlong, pattern)) != 0xFFFF) {
+                return 0;
+            }
+            const __m128i units = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(lanes, _mm_set1_epi16(0x1F)), 6), _mm_and_si128(_mm_srli_epi16(lanes, 8), _mm_set1_epi16(0x3F)));
+            if constexpr (sizeof(Unit) == 2) {
+                Store128(out, units);
+            }
             else {
-                out.push_back(static_cast<char8_t>((wchar >> 12) | 0xE0));
-                out.push_back(static_cast<char8_t>(((wchar >> 6) & 0x3F) | 0x80));
-                out.push_back(static_cast<char8_t>((wchar & 0x3F) | 0x80));
+                Store128(out, _mm_unpacklo_epi16(units, zero));
+                Store128(out + 4, _mm_unpackhi_epi16(units, zero));
             }
-            // On Windows, wchar_t is 16 bits, while on Linux, it's 32 bits
-#ifdef WideCharIsUTF32
-            // Four-byte characters
-            else if (wchar <= 0x10FFFF) {
-                out.push_back(static_cast<char8_t>((wchar >> 18) | 0xF0));
-                out.push_back(static_cast<char8_t>(((wchar >> 12) & 0x3F) | 0x80));
-                out.push_back(static_cast<char8_t>(((wchar >> 6) & 0x3F) | 0x80));
-                out.push_back(static_cast<char8_t>((wchar & 0x3F) | 0x80));
+            return 8;
+        }
+
+        /*
+        * Decodes the first 8 of 16 bytes if they are one and two-byte sequences. Every byte gets a 16-bit lane
+        * holding what it decodes to if it starts a character, both for ASCII and, together with the next byte,
+        * for a lead byte. The lanes of continuation bytes are then dropped with one shuffle picked by
+        * their mask, the rest of "units" is zero. A lead byte in the last position goes to the next step.
+        * Returns false for anything else, otherwise the number of bytes taken and the continuation mask,
+        * which tells how many units there are
+        */
+        inline bool DecodeOneAndTwoByteStep(__m128i bytes, __m128i& units, size_t& consumed, unsigned& continuations) {
+            const __m128i zero = _mm_setzero_si128();
+            const unsigned nonASCII = static_cast<unsigned>(_mm_movemask_epi8(bytes)) & 0xFF;
+            // As signed bytes, continuations are below -64, and the leads of longer sequences are above -33
+            continuations = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-64), bytes))) & 0xFF;
+            const unsigned longLeads = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(-33)))) & nonASCII;
+            const unsigned overlong = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bytes, _mm_set1_epi8(static_cast<char>(0xFE))), _mm_set1_epi8(static_cast<char>(0xC0))))) & 0xFF;
+            const unsigned leads = nonASCII & ~continuations;
+            // Every lead byte must be followed by exactly one continuation byte
+            if ((longLeads | overlong) != 0 || continuations != ((leads << 1) & 0xFF)) {
+                return false;
+            }
+            consumed = (leads & 0x80) != 0 ? 7 : 8;
+
+            const __m128i current = _mm_unpacklo_epi8(bytes, zero);
+            const __m128i next = _mm_unpacklo_epi8(_mm_srli_si128(bytes, 1), zero);
+            const __m128i twoBytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(current, _mm_set1_epi16(0x1F)), 6), _mm_and_si128(next, _mm_set1_epi16(0x3F)));
+            const __m128i isASCII = _mm_cmplt_epi16(current, _mm_set1_epi16(0x80));
+            const __m128i lanes = _mm_or_si128(_mm_and_si128(isASCII, current), _mm_andnot_si128(isASCII, twoBytes));
+            units = _mm_shuffle_epi8(lanes, Load128(dropUnits[continuations].data()));
+            return true;
+        }
+
+        /*
+        * Decodes a run of one and two-byte sequences, DecodeOneAndTwoByteStep at a time.
+        * A step reads 16 bytes, "padding" of them may be past the end of the input.
+        * The stores write 8 units whatever the step decodes to, so a step is only taken while "out"
+        * has room for 8 more: an output sized exactly for invalid input has less room than the input suggests
+        */
+        template<typename Unit>
+        size_t DecodeOneAndTwoByteVector(const char8_t* in, size_t size, size_t padding, Unit* out, size_t capacity, size_t& written) {
+            const __m128i zero = _mm_setzero_si128();
+            size_t i = 0;
+            // The pair step is tried first and then only after a step of nothing but two-byte sequences, in mixed text it would mostly fail
+            bool tryPairs = true;
+            while (i + 8 <= size && i + 16 <= size + padding && written + 8 <= capacity) {
+                if (tryPairs && i + 16 <= size) {
+                    // Eight two-byte sequences in a row, as in a Cyrillic or Greek word, need no shuffle
+                    const size_t pairs = DecodeTwoByteVector(in + i, out + written);
+                    if (pairs != 0) {
+                        written += pairs;
+                        i += pairs * 2;
+                        continue;
+                    }
+                }
+                __m128i packed;
+                size_t consumed;
+                unsigned continuations;
+                if (!DecodeOneAndTwoByteStep(Load128(in + i), packed, consumed, continuations)) {
+                    break;
+                }
+                tryPairs = continuations == 0xAA;
+                if constexpr (sizeof(Unit) == 2) {
+                    Store128(out + written, packed);
+                }
+                else {
+                    Store128(out + written, _mm_unpacklo_epi16(packed, zero));
+                    Store128(out + written + 4, _mm_unpackhi_epi16(packed, zero));
+                }
+                written += consumed - std::popcount(continuations);
+                i += consumed;
             }
+            return i;
+        }
+
+        /*
+        * The way back: encodes 8 16-bit units up to U+07FF. Every unit becomes the two bytes of a two-byte sequence
+        * or an ASCII byte in its 16-bit lane, and the upper bytes of the ASCII lanes are dropped with one shuffle.
+        * Returns the bytes packed at the bottom, "bytes" is their number
+        */
+        inline __m128i EncodeOneAndTwoByteStep(__m128i units, size_t& bytes) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i isASCII = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))), zero);
+            const unsigned ascii = static_cast<unsigned>(_mm_movemask_epi8(_mm_packs_epi16(isASCII, zero))) & 0xFF;
+            // Lead byte at the bottom of the lane, the continuation byte on top
+            const __m128i lead = _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0));
+            const __m128i continuation = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            const __m128i twoBytes = _mm_or_si128(lead, _mm_slli_epi16(continuation, 8));
+            const __m128i lanes = _mm_or_si128(_mm_and_si128(isASCII, units), _mm_andnot_si128(isASCII, twoBytes));
+            bytes = 16 - std::popcount(ascii);
+            return _mm_shuffle_epi8(lanes, Load128(dropUpperBytes[ascii].data()));
+        }
+
+        /*
+        * Encodes a run of units up to U+07FF, EncodeOneAndTwoByteStep at a time.
+        * The store writes 16 bytes; with 8 more units after the step, that never goes past the output
+        */
+        size_t EncodeOneAndTwoByteVector(const wchar_t* in, size_t size, char8_t* out, size_t& written) {
+            const __m128i zero = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 16 <= size; i += 8) {
+#ifdef WideCharIsUTF16
+                const __m128i units = Load128(in + i);
+#else
+                const __m128i low = Load128(in + i);
+                const __m128i high = Load128(in + i + 4);
+                // Nothing above U+07FF, so packing to 16 bits doesn't saturate
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi32(~0x7FF)), zero)) != 0xFFFF) {
+                    break;
+                }
+                const __m128i units = _mm_packs_epi32(low, high);
 #endif
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))), zero)) != 0xFFFF) {
+                    break;
+                }
+                size_t bytes;
+                Store128(out + written, EncodeOneAndTwoByteStep(units, bytes));
+                written += bytes;
+            }
+            return i;
         }
-        return out;
-    }
 
-    std::wstring UTF8ToWideStr(const std::u8string_view in) {
-        std::wstring out;
-        // Preallocate memory for the "out" string to reduce the number of reallocations
-        // 1 utf8 byte  (in.size() / 2 == 0 (exception)) -- 1 utf16 byte
-        // 2 utf8 bytes (in.size() / 2 == 1)         -- 1 utf16 byte
-        // 3 utf8 bytes (in.size() / 2 == 1{.5})     -- 1 utf16 byte
-        // 4 utf8 bytes (in.size() / 2 == 2)         -- 2 utf16 bytes
-        out.reserve(in.size() > 1 ? in.size() / 2 : 1);
-        for (size_t i = 0; i < in.size(); ) {
-            // If the first bit is zero, then it's a single-byte character
-            if ((in[i] & 0x80) == 0) {
-                out.push_back(static_cast<wchar_t>(in[i]));
-                i += 1;
-            }
-            // If the first three bits are 110, then it's a two-byte character
-            else if ((in[i] & 0xE0) == 0xC0) {
-                /*
-                * Example: we have 2 bytes -- 11010001(in[i]) and 10001000(in[i+1])
-                * Apply a mask 00011111 to the first byte to replace
-                * the top three bits with zeros, resulting in 00010001(in[i])
-                *
-                * Apply a mask 00111111 to the second byte to fill
-                * the top two bits with zeros, resulting in 00001000(in[i+1])
-                *
-                * Shift the first byte inwards by 6 bits to make room for
-                * the bits we need from the second byte in[i+1], resulting in
-                * 00000000 00000000 00000100 01000000 (inside in)
-                *
-                * Simply add the remaining bits from the second byte in[i+1]
-                * to this variable to get 00000000 00000000 00000100 01001000
-                * Voilà! We have a UTF32 character!
-                */
-                out.push_back(static_cast<wchar_t>(((in[i] & 0x1F) << 6) | (in[i + 1] & 0x3F)));
+        /*
+        * Latin-1 is U+0000..U+00FF, so it goes through the same steps as the one and two-byte kernels.
+        * Encoding widens 8 bytes to 16-bit units per step; the store writes 16 bytes, which an output
+        * of twice the input's size has room for while 8 bytes of input are left
+        */
+        size_t EncodeLatin1Vector(const unsigned char* in, size_t size, char8_t* out, size_t& written) {
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                size_t bytes;
+                Store128(out + written, EncodeOneAndTwoByteStep(_mm_unpacklo_epi8(Load64(in + i), _mm_setzero_si128()), bytes));
+                written += bytes;
+            }
+            return i;
+        }
+
+        /*
+        * Decoding also checks that every unit fits in a byte and packs the units to bytes.
+        * The store writes 8 bytes, the output is as long as the input and a step reads 16 bytes of it
+        */
+        size_t DecodeUTF8ToLatin1Vector(const char8_t* in, size_t size, char* out, size_t& written) {
+            size_t i = 0;
+            while (i + 16 <= size) {
+                __m128i units;
+                size_t consumed;
+                unsigned continuations;
+                if (!DecodeOneAndTwoByteStep(Load128(in + i), units, consumed, continuations)
+                    || _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_srli_epi16(units, 8), _mm_setzero_si128())) != 0xFFFF) {
+                    break;
+                }
+                Store64(out + written, _mm_packus_epi16(units, units));
+                written += consumed - std::popcount(continuations);
+                i += consumed;
+            }
+            return i;
+        }
+#endif
+
+        /*
+        * Decodes a run of one and two-byte sequences, the usual mix of Cyrillic, Greek, Hebrew
+        * or Arabic letters with ASCII spaces and punctuation. Stops at the first byte that starts
+        * anything else or an invalid sequence, returns the number of bytes decoded and moves "written" on.
+        * "capacity" is the number of units "out" has room for
+        */
+        template<typename Unit>
+        size_t DecodeOneAndTwoByteSequences(const char8_t* in, size_t size, size_t padding, Unit* out, size_t capacity, size_t& written) {
+#ifndef CharConvertersSSSE3
+            static_cast<void>(padding);
+            static_cast<void>(capacity);
+#endif
+            size_t i = 0;
+            while (i < size) {
+#ifdef CharConvertersSSSE3
+                // Vector steps while they can, then one character here and back to them
+                i += DecodeOneAndTwoByteVector(in + i, size - i, padding, out, capacity, written);
+                if (i == size) {
+                    break;
+                }
+#endif
+                const uint32_t lead = in[i];
+                if (lead < 0x80) {
+                    out[written++] = static_cast<Unit>(lead);
+                    ++i;
+                    continue;
+                }
+                // 0xC0 and 0xC1 would be overlong forms of ASCII
+                if (lead < 0xC2 || lead > 0xDF || i + 1 == size || (in[i + 1] & 0xC0) != 0x80) {
+                    break;
+                }
+                out[written++] = static_cast<Unit>(((lead & 0x1F) << 6) | (in[i + 1] & 0x3F));
                 i += 2;
             }
-            // If the first four bits are 1110, then it's a three-byte character
-            else if ((in[i] & 0xF0) == 0xE0) {
+            return i;
+        }
+
+        /*
+        * Decodes a run of three-byte sequences, the bulk of Chinese and Japanese text.
+        * Stops at the first sequence that isn't one, an overlong form or a surrogate included
+        */
+        template<typename Unit>
+        size_t DecodeThreeByteSequences(const char8_t* in, size_t size, size_t padding, Unit* out, size_t& written) {
+#ifndef CharConvertersSSSE3
+            static_cast<void>(padding);
+#endif
+            size_t i = 0;
+#ifdef CharConvertersSSSE3
+            /*
+            * Four sequences, 12 bytes, per step. One shuffle puts every sequence in its own 32-bit lane,
+            * reversed so the lead byte lands in bits 16..23, and the code points are then put together
+            * with shifts and masks. The load reads 4 bytes past the sequences, so without "padding" bytes
+            * readable past the end of the input the loop stops 16 bytes before it
+            */
+            const __m128i gather = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+            for (; i + 12 <= size && i + 16 <= size + padding; i += 12) {
+                const __m128i lanes = _mm_shuffle_epi8(Load128(in + i), gather);
+                const __m128i pattern = _mm_cmpeq_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0xF0C0C0)), _mm_set1_epi32(0xE08080));
+                const __m128i codePoints = _mm_or_si128(_mm_and_si128(lanes, _mm_set1_epi32(0x3F)),
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xFC0)), _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xF000))));
+                // No overlong forms and no surrogates
+                const __m128i surrogates = _mm_cmpeq_epi32(_mm_and_si128(codePoints, _mm_set1_epi32(0xF800)), _mm_set1_epi32(0xD800));
+                const __m128i valid = _mm_andnot_si128(surrogates, _mm_and_si128(pattern, _mm_cmpgt_epi32(codePoints, _mm_set1_epi32(0x7FF))));
+                if (_mm_movemask_epi8(valid) != 0xFFFF) {
+                    break;
+                }
+                if constexpr (sizeof(Unit) == 2) {
+                    // packs saturates signed values, so the code points are moved into the signed range and back
+                    const __m128i bias = _mm_set1_epi32(0x8000);
+                    const __m128i units = _mm_add_epi16(_mm_packs_epi32(_mm_sub_epi32(codePoints, bias), bias), _mm_set1_epi16(static_cast<short>(0x8000)));
+                    Store64(out + written, units);
+                }
+                else {
+                    Store128(out + written, codePoints);
+                }
+                written += 4;
+            }
+#endif
+            for (; i + 3 <= size; i += 3) {
+                if ((in[i] & 0xF0) != 0xE0 || (in[i + 1] & 0xC0) != 0x80 || (in[i + 2] & 0xC0) != 0x80) {
+                    break;
+                }
+                const uint32_t codePoint = ((in[i] & 0x0F) << 12) | ((in[i + 1] & 0x3F) << 6) | (in[i + 2] & 0x3F);
+                if (codePoint < 0x800 || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+                    break;
+                }
+                out[written++] = static_cast<Unit>(codePoint);
+            }
+            return i;
+        }
+
+        /*
+        * Decodes from "i" with the DFA until the first code point boundary at or after "end",
+        * returns where it stopped and moves "written" on.
+        * Between characters the loop branches on the state and on the next byte, to hand ASCII runs
+        * over to WidenASCII. Inside a sequence a step is one table lookup with no branches on the data:
+        * it stores the current code point and moves the output only if the DFA has just accepted a character.
+        * The loop stops as soon as a byte is rejected, utf8Reject never changes,
+        * so the error is reported after it without reading the rest of the input
+        */
+        template<typename Unit>
+        size_t DecodeWithDFA(const char8_t* in, size_t size, size_t i, size_t end, Unit* out, size_t& written, const char*& error) {
+            uint32_t state = utf8Accept;
+            uint32_t codePoint = 0;
+            for (; i < size; ++i) {
+                if (state == utf8Accept) {
+                    if (i >= end) {
+                        break;
+                    }
+                    // Between characters, an ASCII run is widened by the SIMD helpers
+                    if (in[i] < 0x80) {
+                        const size_t ascii = WidenASCII(in + i, end - i, out + written);
+                        written += ascii;
+                        i += ascii;
+                        if (i >= end) {
+                            break;
+                        }
+                    }
+                }
+                else if (state == utf8Reject) {
+                    break;
+                }
+                codePoint = DecodeStep(state, codePoint, in[i]);
+                const size_t accepted = state == utf8Accept;
+                if constexpr (sizeof(Unit) == 2) {
+                    /*
+                    * Everything is done according to the formula from here:
+                    * https://en.wikipedia.org/wiki/UTF-16#Examples
+                    * Example: We have 0x00010437 in UTF32
+                    * First subtract 0x10000 and get 0x00000437
+                    * Shift right by 10 and add 0xD800 to find the high surrogate
+                    * Take the lowest 10 bits (remainder after dividing by 0x400) and add 0xDC00
+                    * Voilà! UTF16 surrogate pair!
+                    * Both units are always stored, the second one is overwritten if it isn't needed
+                    */
+                    const size_t surrogatePair = codePoint > 0xFFFF;
+                    out[written] = static_cast<Unit>(surrogatePair ? ((codePoint - 0x10000) >> 10) + 0xD800 : codePoint);
+                    out[written + 1] = static_cast<Unit>((codePoint % 0x400) + 0xDC00);
+                    written += accepted << surrogatePair;
+                }
+                else {
+                    out[written] = static_cast<Unit>(codePoint);
+                    written += accepted;
+                }
+            }
+            // Either a byte was rejected or the input ends in the middle of a sequence
+            if (state != utf8Accept) {
+                error = "Invalid character";
+            }
+            return i;
+        }
+
+        /*
+        * What most of a block of UTF-8 is made of, found by counting lead bytes 8 at a time.
+        * Bits 7..4 of a byte tell its kind: 0xxx is ASCII, 110x, 1110 and 1111 start sequences of 2, 3 and 4 bytes.
+        * Shifting a word left moves the lower bits of every byte under its top bit, so ANDing the shifted words
+        * leaves the top bit set only in the bytes that have all of those bits set.
+        * The top bits are moved down and added up per byte, and the bytes of the sums are added once per block
+        * with a multiply, so there's no popcount per word (which is a library call without -mpopcnt)
+        */
+        enum class BlockKind
+        {
+            ASCII,
+            OneAndTwoByte,
+            ThreeByte,
+            FourByte,
+            Mixed,
+        };
+
+        constexpr size_t classifiedBytes = 64;
+        // Shorter blocks go straight to the DFA, the kernels would have too little to work on to pay for the classification
+        constexpr size_t minClassifiedBytes = 32;
+        // Every byte of a sum counts one byte of every word, so it can't overflow
+        static_assert(classifiedBytes / 8 <= 0xFF);
+
+        // Sum of the bytes of "word", collected in its top byte
+        inline size_t SumBytes(uint64_t word) {
+            return static_cast<size_t>((word * 0x0101010101010101) >> 56);
+        }
+
+        BlockKind ClassifyBlock(const char8_t* in, size_t size) {
+            constexpr uint64_t lowBits = 0x0101010101010101;
+            uint64_t nonASCIISums = 0;
+            uint64_t longLeadSums = 0;
+            uint64_t fourByteLeadSums = 0;
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                const uint64_t word = LoadWord(in + i);
+                const uint64_t threeBits = word & (word << 1) & (word << 2);
+                nonASCIISums += (word >> 7) & lowBits;
+                longLeadSums += (threeBits >> 7) & lowBits;
+                fourByteLeadSums += ((threeBits & (word << 3)) >> 7) & lowBits;
+            }
+            size_t nonASCII = SumBytes(nonASCIISums);
+            size_t longLeads = SumBytes(longLeadSums);
+            size_t fourByteLeads = SumBytes(fourByteLeadSums);
+            for (; i < size; ++i) {
+                nonASCII += in[i] >= 0x80;
+                longLeads += in[i] >= 0xE0;
+                fourByteLeads += in[i] >= 0xF0;
+            }
+            if (nonASCII == 0) {
+                return BlockKind::ASCII;
+            }
+            if (longLeads == 0) {
+                return BlockKind::OneAndTwoByte;
+            }
+            // Three quarters of the bytes or more in sequences of one length
+            const size_t threeByteLeads = longLeads - fourByteLeads;
+            if (threeByteLeads * 4 >= size) {
+                return BlockKind::ThreeByte;
+            }
+            if (fourByteLeads * 16 >= size * 3) {
+                return BlockKind::FourByte;
+            }
+            return BlockKind::Mixed;
+        }
+
+        /*
+        * Decodes "size" bytes of UTF-8 into "out" as UTF-16 or UTF-32, depending on the size of Unit.
+        * "out" has room for "capacity" code units, which must be at least as many as the result plus one.
+        * The input is classified a block of 64 bytes at a time, and every block starts with the kernel
+        * for what it's made of; a block shorter than minClassifiedBytes, such as all of a short input, goes
+        * to the DFA as it is. Kernels stop at the first byte they don't handle, and whatever they leave
+        * of the block goes through the DFA, which handles everything and reports errors.
+        * If "Padded", inputPadding bytes past the end of the input may be read and "out" must have room
+        * for inputPadding more units, so the kernels keep their full-width loads and stores up to the end
+        */
+        template<typename Unit, bool Padded = false>
+        size_t DecodeUTF8(const char8_t* in, size_t size, Unit* out, size_t capacity, const char*& error) {
+            constexpr size_t padding = Padded ? inputPadding : 0;
+            size_t written = 0;
+            size_t i = 0;
+            while (i < size) {
+                const size_t end = std::min(size, i + classifiedBytes);
+                switch (end - i >= minClassifiedBytes ? ClassifyBlock(in + i, end - i) : BlockKind::Mixed) {
+                case BlockKind::ASCII: {
+#ifdef CharConvertersSSE2
+                    const size_t ascii = Padded ? WidenASCIIPadded(in + i, size - i, out + written) : WidenASCII(in + i, size - i, out + written);
+#else
+                    const size_t ascii = WidenASCII(in + i, size - i, out + written);
+#endif
+                    written += ascii;
+                    i += ascii;
+                    break;
+                }
+                case BlockKind::OneAndTwoByte:
+                    i += DecodeOneAndTwoByteSequences(in + i, size - i, padding, out, capacity, written);
+                    break;
+                case BlockKind::ThreeByte:
+                    i += DecodeThreeByteSequences(in + i, size - i, padding, out, written);
+                    break;
+#ifdef CharConvertersSSE2
+                case BlockKind::FourByte:
+                    i += DecodeFourByteSequences(in + i, size - i, out, written);
+                    break;
+#endif
+                default:
+                    break;
+                }
+                i = DecodeWithDFA(in, size, i, end, out, written, error);
+                if (error) {
+                    break;
+                }
+            }
+            return written;
+        }
+
+        // Widens eight ASCII bytes, fully unrolled
+        inline void WidenASCII8(const char8_t* in, wchar_t* out) {
+            out[0] = static_cast<wchar_t>(in[0]);
+            out[1] = static_cast<wchar_t>(in[1]);
+            out[2] = static_cast<wchar_t>(in[2]);
+            out[3] = static_cast<wchar_t>(in[3]);
+            out[4] = static_cast<wchar_t>(in[4]);
+            out[5] = static_cast<wchar_t>(in[5]);
+            out[6] = static_cast<wchar_t>(in[6]);
+            out[7] = static_cast<wchar_t>(in[7]);
+        }
+
+        /*
+        * Kernel for short inputs: eight bytes per step without a loop over single bytes,
+        * as long as they are ASCII. The first non-ASCII block hands the rest over to DecodeUTF8
+        */
+        size_t DecodeShortUTF8(const char8_t* in, size_t size, wchar_t* out, size_t capacity, const char*& error) {
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                if (((in[i] | in[i + 1] | in[i + 2] | in[i + 3] | in[i + 4] | in[i + 5] | in[i + 6] | in[i + 7]) & 0x80) != 0) {
+                    break;
+                }
+                WidenASCII8(in + i, out + i);
+            }
+            return i + DecodeUTF8(in + i, size - i, out + i, capacity - i, error);
+        }
+
+        // Encodes "size" code units into "out", which must have room for MaxUTF8Units(size) bytes
+        size_t EncodeUTF8(const wchar_t* in, size_t size, char8_t* out, const char*& error) {
+            size_t written = 0;
+#ifdef WideCharIsUTF16
+            uint32_t codePoint = 0;
+            bool highSurrogate = false;
+#endif
+            for (size_t i = 0; i < size; ++i) {
+                const uint32_t wchar = static_cast<uint32_t>(in[i]);
+#ifdef WideCharIsUTF16
+                if (highSurrogate && (wchar < 0xDC00 || wchar > 0xDFFF)) {
+                    error = "Invalid UTF-16 sequence: missing low surrogate";
+                    return written;
+                }
+#endif
                 /*
-                * Same as above, but the mask for the first byte replaces the top four bits with zeros,
-                * and everything shifts considering one more byte
+                * +--------------+--------------+----------+----------+----------+----------+
+                * | Code point   | Code point   | Byte 1   | Byte 2   | Byte 3   | Byte 4   |
+                * | (First)      | (Last)       |          |          |          |          |
+                * +--------------+--------------+----------+----------+----------+----------+
+                * | U+0000       | U+007F       | 0xxxxxxx |          |          |          |
+                * | U+0080       | U+07FF       | 110xxxxx | 10xxxxxx |          |          |
+                * | U+0800       | U+FFFF       | 1110xxxx | 10xxxxxx | 10xxxxxx |          |
+                * | U+10000      | U+10FFFF     | 11110xxx | 10xxxxxx | 10xxxxxx | 10xxxxxx |
+                * +--------------+--------------+----------+----------+----------+----------+
                 */
-                out.push_back(static_cast<wchar_t>(((in[i] & 0x0F) << 12) | ((in[i + 1] & 0x3F) << 6) | (in[i + 2] & 0x3F)));
-                i += 3;
-            }
-            // If the first five bits are 11110, then it's a four-byte character
-            else if ((in[i] & 0xF8) == 0xF0) {
+                // Single-byte character, the whole ASCII run is copied at once
+                if (wchar <= 0x7F) {
+                    const size_t ascii = NarrowASCII(in + i, size - i, out + written);
+                    written += ascii;
+                    i += ascii - 1;
+                }
+                // Two-byte character
+                else if (wchar <= 0x07FF) {
+#ifdef CharConvertersSSSE3
+                    // A run of one and two-byte characters is encoded 8 units at a time
+                    const size_t run = EncodeOneAndTwoByteVector(in + i, size - i, out, written);
+                    if (run != 0) {
+                        i += run - 1;
+#ifdef WideCharIsUTF16
+                        highSurrogate = false;
+#endif
+                        continue;
+                    }
+#endif
+                    /*
+                    * For example, let's take the character 0000001110100110 (0x03A6) and
+                    * convert it to 11001110 10100110 (0xCE 0xA6)
+                    * First byte:
+                    * 1. Shift right by 6: 00001110
+                    * 2. Add 11000000: 11001110 -- this gives us the first byte
+                    * Second byte:
+                    * 1. Apply a mask 00111111 (0x3F) to 10100110 (first 8 bits of 0x03A6): 00100110
+                    * 2. Add 10000000 (0x80): 10100110
+                    */
+                    out[written++] = static_cast<char8_t>((wchar >> 6) | 0xC0);
+                    out[written++] = static_cast<char8_t>((wchar & 0x3F) | 0x80);
+                }
                 // On Windows, wchar_t is 16 bits, while on Linux, it's 32 bits
-#ifdef _WIN32
+#ifdef WideCharIsUTF16
                 /*
-                * Same as above, but the mask for the first byte replaces the top five bits with zeros,
-                * and everything shifts considering one more byte
+                * All according to the formula from https://en.wikipedia.org/wiki/UTF-16#Examples
+                * For example, let's consider 0xD801 0xDC37
+                * For the high surrogate:
+                * 1. Subtract 0xD800 from the high surrogate 0xD801: (0x0001)
+                * 2. Multiply by 0x400: 0x0001 * 0x400 == 0x0400
+                * For the low surrogate:
+                * 1. Subtract 0xDC00 from the low surrogate 0xDC37: 00110111 (0x37)
+                * Final step:
+                * 1. Add the obtained results: 0x0400 + 0x37 == 0x0437
+                * 2. Add 0x10000: 0x0437 + 0x10437
+                * Voilà! We have a UTF-32 character, which can now be converted to UTF-8 (see ConvertUTF8ToWideString)!
                 */
-                uint32_t u32 = ((in[i] & 0x07) << 24) | ((in[i + 1] & 0x3F) << 12) | ((in[i + 2] & 0x3F) << 6) | (in[i + 3] & 0x3F);
+                // Surrogates for four-byte characters
+                // High surrogate: U+D800 - U+DBFF
+                // Low surrogate: U+DC00 - U+DFFF
+                else if (wchar >= 0xD800 && wchar <= 0xDBFF) {
+#ifdef CharConvertersSSE2
+                    // A run of surrogate pairs is encoded 4 pairs at a time
+                    const size_t pairs = EncodeSupplementary(in + i, size - i, out + written);
+                    if (pairs != 0) {
+                        written += pairs * 2;
+                        i += pairs - 1;
+                        highSurrogate = false;
+                        continue;
+                    }
+#endif
+                    codePoint = ((wchar - 0xD800) * 0x400);
+                    highSurrogate = true;
+                    continue;
+                }
+                else if (wchar >= 0xDC00 && wchar <= 0xDFFF) {
+                    if (!highSurrogate) {
+                        error = "Invalid UTF-16 sequence: unexpected low surrogate";
+                        return written;
+                    }
+                    codePoint += (wchar - 0xDC00);
+                    codePoint += 0x10000;
+                    if (codePoint > 0x10FFFF) {
+                        error = "Invalid UTF-16 sequence: low surrogate is out of range";
+                        return written;
+                    }
+                    out[written++] = static_cast<char8_t>((codePoint >> 18) | 0xF0);
+                    out[written++] = static_cast<char8_t>(((codePoint >> 12) & 0x3F) | 0x80);
+                    out[written++] = static_cast<char8_t>(((codePoint >> 6) & 0x3F) | 0x80);
+                    out[written++] = static_cast<char8_t>((codePoint & 0x3F) | 0x80);
+                }
+#else
+                // Four-byte characters
+                else if (wchar > 0xFFFF) {
+#ifdef CharConvertersSSE2
+                    // A run of them is encoded 4 code points at a time
+                    const size_t run = EncodeSupplementary(in + i, size - i, out + written);
+                    if (run != 0) {
+                        written += run * 4;
+                        i += run - 1;
+                        continue;
+                    }
+#endif
+                    if (wchar > 0x10FFFF) {
+                        error = "Invalid UTF-32 character: code point is out of range";
+                        return written;
+                    }
+                    out[written++] = static_cast<char8_t>((wchar >> 18) | 0xF0);
+                    out[written++] = static_cast<char8_t>(((wchar >> 12) & 0x3F) | 0x80);
+                    out[written++] = static_cast<char8_t>(((wchar >> 6) & 0x3F) | 0x80);
+                    out[written++] = static_cast<char8_t>((wchar & 0x3F) | 0x80);
+                }
+#endif
                 /*
-                * Everything is done according to the formula from here:
-                * https://en.wikipedia.org/wiki/UTF-16#Examples
-                * Example: We have 0x00010437 in UTF32
-                * First subtract 0x10000 and get 0x00000437
-                * Shift right by 10 and add 0xD800 to find the high surrogate
-                * Shift the high surrogate left by 16 to make room for the low surrogate
-                * Take the lowest 10 bits (remainder after dividing by 0x400) and add 0xDC00
-                * Simply combine these two bytes together
-                * Voilà! UTF16 surrogate pair!
+                * Exactly the same as for two-byte characters,
+                * with an additional byte taken into account
                 */
-                out.push_back(static_cast<wchar_t>(((u32 - 0x10000) >> 10) + 0xD800));
-                out.push_back(static_cast<wchar_t>((u32 % 0x400) + 0xDC00));
+                // Three-byte characters
+                else {
+                    out[written++] = static_cast<char8_t>((wchar >> 12) | 0xE0);
+                    out[written++] = static_cast<char8_t>(((wchar >> 6) & 0x3F) | 0x80);
+                    out[written++] = static_cast<char8_t>((wchar & 0x3F) | 0x80);
+                }
+#ifdef WideCharIsUTF16
+                highSurrogate = false;
+#endif
+            }
+#ifdef WideCharIsUTF16
+            // The input ends right after a high surrogate
+            if (highSurrogate) {
+                error = "Invalid UTF-16 sequence: missing low surrogate";
+            }
+#endif
+            return written;
+        }
+
+        /*
+        * Exact number of bytes EncodeUTF8 writes for valid input. Every surrogate counts two bytes,
+        * so a pair gives its four-byte sequence. For invalid input it's still an upper bound:
+        * EncodeUTF8 writes nothing for a high surrogate and only writes a low one right after a high one
+        */
+        size_t UTF8Length(const wchar_t* in, size_t size) {
+            size_t length = 0;
+            size_t i = 0;
+#ifdef CharConvertersSSE2
+            // Every comparison sets all bytes of a unit, so a mask popcount is the number of units times their size
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 / sizeof(wchar_t) <= size; i += 16 / sizeof(wchar_t)) {
+                const __m128i units = Load128(in + i);
+#ifdef WideCharIsUTF16
+                const int ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))), zero));
+                const int twoBytes = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))), zero));
+                const int surrogates = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))), _mm_set1_epi16(static_cast<short>(0xD800))));
+                // 3 bytes per unit, less one for every unit up to 0x7FF, one more for every unit up to 0x7F, one less per surrogate
+                length += 24 - static_cast<size_t>(std::popcount(static_cast<unsigned>(ascii)) + std::popcount(static_cast<unsigned>(twoBytes))
+                    + std::popcount(static_cast<unsigned>(surrogates))) / 2;
 #else
-                out.push_back(static_cast<wchar_t>(((in[i] & 0x07) << 24) | ((in[i + 1] & 0x3F) << 12) | ((in[i + 2] & 0x3F) << 6) | (in[i + 3] & 0x3F)));
+                const int ascii = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(units, _mm_set1_epi32(~0x7F)), zero));
+                const int twoBytes = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(units, _mm_set1_epi32(~0x7FF)), zero));
+                const int threeBytes = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(units, _mm_set1_epi32(~0xFFFF)), zero));
+                // 4 bytes per unit, less one for every unit up to each of the limits
+                length += 16 - static_cast<size_t>(std::popcount(static_cast<unsigned>(ascii)) + std::popcount(static_cast<unsigned>(twoBytes))
+                    + std::popcount(static_cast<unsigned>(threeBytes))) / 4;
 #endif
-                i += 4;
             }
-            // This is not a UTF8 character
-            else {
-                throw std::invalid_argument("Invalid character");
-                break;
+#endif
+            for (; i < size; ++i) {
+                const uint32_t wchar = static_cast<uint32_t>(in[i]);
+#ifdef WideCharIsUTF16
+                const bool surrogate = (wchar & 0xF800) == 0xD800;
+                length += surrogate ? 2 : 1 + (wchar > 0x7F) + (wchar > 0x7FF);
+#else
+                length += 1 + (wchar > 0x7F) + (wchar > 0x7FF) + (wchar > 0xFFFF);
+#endif
             }
+            return length;
+        }
+
+        /*
+        * Exact number of code units DecodeUTF8 writes for valid input: one per lead byte,
+        * and on top of that one more for every four-byte sequence if the units are 16 bits.
+        * Continuation bytes are 0x80..0xBF, so as signed bytes they're the only ones below -64
+        */
+        template<typename Unit>
+        size_t WideLength(const char8_t* in, size_t size) {
+            size_t length = 0;
+            size_t i = 0;
+#ifdef CharConvertersSSE2
+            for (; i + 16 <= size; i += 16) {
+                const __m128i bytes = Load128(in + i);
+                length += std::popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(-65)))));
+                if constexpr (sizeof(Unit) == 2) {
+                    // A byte is at least 0xF0 if the unsigned maximum with 0xF0 leaves it unchanged
+                    const __m128i fourBytes = _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8(static_cast<char>(0xF0))), bytes);
+                    length += std::popcount(static_cast<unsigned>(_mm_movemask_epi8(fourBytes)));
+                }
+            }
+#endif
+            if constexpr (swarEnabled) {
+                // Shifting left moves the lower bits of every byte under its top bit without crossing into the next byte
+                for (; i + 8 <= size; i += 8) {
+                    const uint64_t word = LoadWord(in + i);
+                    const uint64_t continuation = word & ~(word << 1) & 0x8080808080808080;
+                    length += 8 - std::popcount(continuation);
+                    if constexpr (sizeof(Unit) == 2) {
+                        length += std::popcount(word & (word << 1) & (word << 2) & (word << 3) & 0x8080808080808080);
+                    }
+                }
+            }
+            for (; i < size; ++i) {
+                length += (in[i] & 0xC0) != 0x80;
+                if constexpr (sizeof(Unit) == 2) {
+                    length += in[i] >= 0xF0;
+                }
+            }
+            return length;
+        }
+
+        /*
+        * Number of leading units of "in" whose UTF-8 takes at most "maxBytes", written to "bytes".
+        * Whole blocks are measured with UTF8Length, the block the budget runs out in one unit at a time
+        */
+        size_t UTF8Prefix(const wchar_t* in, size_t size, size_t maxBytes, size_t& bytes) {
+            constexpr size_t block = 64;
+            size_t i = 0;
+            bytes = 0;
+            for (; i + block <= size; i += block) {
+                const size_t length = UTF8Length(in + i, block);
+                if (bytes + length > maxBytes) {
+                    break;
+                }
+                bytes += length;
+            }
+            for (; i < size; ++i) {
+                const size_t length = UTF8Length(in + i, 1);
+                if (bytes + length > maxBytes) {
+                    break;
+                }
+                bytes += length;
+            }
+#ifdef WideCharIsUTF16
+            // The low surrogate didn't fit, so neither does the pair. An unpaired high surrogate stays for EncodeUTF8 to report
+            if (i > 0 && i < size && in[i - 1] >= 0xD800 && in[i - 1] <= 0xDBFF && in[i] >= 0xDC00 && in[i] <= 0xDFFF) {
+                --i;
+                bytes -= 2;
+            }
+#endif
+            return i;
         }
-        return out;
-    }
-}
 
+        /*
+        * Number of leading bytes of "in" whose code points take at most "maxUnits" units, written to "units",
+        * always a code point boundary as a sequence costs its units at the lead byte
+        */
+        template<typename Unit>
+        size_t WidePrefix(const char8_t* in, size_t size, size_t maxUnits, size_t& units) {
+            constexpr size_t block = 64;
+            size_t i = 0;
+            units = 0;
+            for (; i + block <= size; i += block) {
+                const size_t length = WideLength<Unit>(in + i, block);
+                if (units + length > maxUnits) {
+                    break;
+                }
+                units += length;
+            }
+            for (; i < size; ++i) {
+                const size_t length = WideLength<Unit>(in + i, 1);
+                if (units + length > maxUnits) {
+                    break;
+                }
+                units += length;
+            }
+            return i;
+        }
+
+        /*
+        * Byte offset of the code point boundary at UTF-16 index "target", or of the start of the code point
+        * the index falls into, scanning from "start" where the index is "units". "start" may be a continuation
+        * byte of a sequence already counted
+        */
+        size_t ScanToUTF16Index(const std::u8string_view in, size_t start, size_t units, size_t target) {
+            size_t i = start;
+            for (; i < in.size(); ++i) {
+                if ((in[i] & 0xC0) == 0x80) {
+                    continue;
+                }
+                const size_t length = in[i] >= 0xF0 ? 2 : 1;
+                if (units + length > target) {
+                    break;
+                }
+                units += length;
+            }
+            return i;
+        }
+
+        /*
+        * Length of the longest prefix of "in" not longer than "size" that ends on a code point boundary,
+        * as TruncateUTF8 cuts it; if nothing is left after that, the first sequence is taken on its own.
+        * Invalid input is left for the decoder to report
+        */
+        size_t CodePointPrefix(const std::u8string_view in, size_t size) {
+            size = TruncateUTF8(in, size).size();
+            if (size == 0 && !in.empty()) {
+                const size_t length = in[0] >= 0xF0 ? 4 : in[0] >= 0xE0 ? 3 : in[0] >= 0xC0 ? 2 : 1;
+                size = std::min(length, in.size());
+            }
+            return size;
+        }
+
+        /*
+        * Converts "units" UTF-32 code units stored at "buffer" to UTF-8 at the same address.
+        * A code point never takes more bytes in UTF-8 than in UTF-32, so every unit is read
+        * before its bytes can be overwritten. The buffer is only accessed through
+        * unsigned char and memcpy, which may alias the storage of any type
+        */
+        size_t EncodeUTF32InPlace(unsigned char* buffer, size_t units, const char*& error) {
+            size_t written = 0;
+            for (size_t i = 0; i < units; ++i) {
+                uint32_t codePoint;
+                std::memcpy(&codePoint, buffer + i * sizeof(codePoint), sizeof(codePoint));
+                if (codePoint <= 0x7F) {
+                    buffer[written++] = static_cast<unsigned char>(codePoint);
+                }
+                else if (codePoint <= 0x07FF) {
+                    buffer[written++] = static_cast<unsigned char>((codePoint >> 6) | 0xC0);
+                    buffer[written++] = static_cast<unsigned char>((codePoint & 0x3F) | 0x80);
+                }
+                else if (codePoint <= 0xFFFF) {
+                    buffer[written++] = static_cast<unsigned char>((codePoint >> 12) | 0xE0);
+                    buffer[written++] = static_cast<unsigned char>(((codePoint >> 6) & 0x3F) | 0x80);
+                    buffer[written++] = static_cast<unsigned char>((codePoint & 0x3F) | 0x80);
+                }
+                else if (codePoint <= 0x10FFFF) {
+                    buffer[written++] = static_cast<unsigned char>((codePoint >> 18) | 0xF0);
+                    buffer[written++] = static_cast<unsigned char>(((codePoint >> 12) & 0x3F) | 0x80);
+                    buffer[written++] = static_cast<unsigned char>(((codePoint >> 6) & 0x3F) | 0x80);
+                    buffer[written++] = static_cast<unsigned char>((codePoint & 0x3F) | 0x80);
+                }
+                else {
+                    error = "Invalid UTF-32 character: code point is out of range";
+                    return written;
+                }
+            }
+            return written;
+        }
+
+        /*
+        * Expands the "size" bytes of UTF-8 at "in" to UTF-16 at "out", both inside the same buffer,
+        * with the input ending at least 2 * size bytes after "out", so "in" is at least "size" bytes after it.
+        * A UTF-8 byte never gives more than 2 bytes of UTF-16, so once "i" bytes are read the output
+        * ends at out + 2 * i at most, which is no later than in + i, the first byte not read yet
+        */
+        size_t DecodeUTF8ToUTF16InPlace(unsigned char* out, const unsigned char* in, size_t size, const char*& error) {
+            size_t written = 0;
+            uint32_t state = utf8Accept;
+            uint32_t codePoint = 0;
+            for (size_t i = 0; i < size; ++i) {
+                codePoint = DecodeStep(state, codePoint, in[i]);
+                if (state == utf8Reject) {
+                    break;
+                }
+                if (state != utf8Accept) {
+                    continue;
+                }
+                char16_t units[2];
+                size_t count = 1;
+                if (codePoint > 0xFFFF) {
+                    units[0] = static_cast<char16_t>(((codePoint - 0x10000) >> 10) + 0xD800);
+                    units[1] = static_cast<char16_t>((codePoint % 0x400) + 0xDC00);
+                    count = 2;
+                }
+                else {
+                    units[0] = static_cast<char16_t>(codePoint);
+                }
+                std::memcpy(out + written * sizeof(char16_t), units, count * sizeof(char16_t));
+                written += count;
+            }
+            if (state != utf8Accept) {
+                error = "Invalid character";
+            }
+            return written;
+        }
+
+        // Decodes the UTF-8 sequence at the start of "in", returns its length or zero if it isn't valid
+        size_t DecodeSequence(const char8_t* in, size_t size, uint32_t& codePoint) {
+            uint32_t state = utf8Accept;
+            codePoint = 0;
+            for (size_t i = 0; i < size && i < 4; ++i) {
+                codePoint = DecodeStep(state, codePoint, in[i]);
+                if (state == utf8Accept) {
+                    return i + 1;
+                }
+                if (state == utf8Reject) {
+                    return 0;
+                }
+            }
+            return 0;
+        }
+
+        /*
+        * Latin-1 is the first 256 code points, so a byte either is ASCII and stays as it is,
+        * or becomes 110000xx 10xxxxxx. ASCII runs are found with SIMD and copied in one go,
+        * with SSSE3 the rest is expanded 8 bytes at a time by EncodeLatin1Vector
+        */
+        size_t EncodeLatin1ToUTF8(const unsigned char* in, size_t size, char8_t* out) {
+            size_t written = 0;
+            for (size_t i = 0; i < size; ) {
+                const size_t ascii = ASCIIPrefixLength(in + i, size - i);
+                std::memcpy(out + written, in + i, ascii);
+                written += ascii;
+                i += ascii;
+#ifdef CharConvertersSSSE3
+                i += EncodeLatin1Vector(in + i, size - i, out, written);
+#endif
+                for (; i < size && in[i] >= 0x80; ++i) {
+                    out[written++] = static_cast<char8_t>((in[i] >> 6) | 0xC0);
+                    out[written++] = static_cast<char8_t>((in[i] & 0x3F) | 0x80);
+                }
+            }
+            return written;
+        }
+
+        /*
+        * The other way around: besides ASCII only 0xC2 and 0xC3 followed by a continuation byte are allowed.
+        * With SSSE3 runs of them are packed by DecodeUTF8ToLatin1Vector, which stops at the first step that isn't all Latin-1
+        */
+        size_t DecodeUTF8ToLatin1(const char8_t* in, size_t size, char* out, const char*& error) {
+            size_t written = 0;
+            for (size_t i = 0; i < size; ) {
+                const size_t ascii = ASCIIPrefixLength(in + i, size - i);
+                std::memcpy(out + written, in + i, ascii);
+                written += ascii;
+                i += ascii;
+#ifdef CharConvertersSSSE3
+                // Where the vector loop stopped may be ASCII again
+                const size_t vectorized = DecodeUTF8ToLatin1Vector(in + i, size - i, out, written);
+                if (vectorized != 0) {
+                    i += vectorized;
+                    continue;
+                }
+#endif
+                if (i == size) {
+                    break;
+                }
+                if ((in[i] == 0xC2 || in[i] == 0xC3) && i + 1 < size && (in[i + 1] & 0xC0) == 0x80) {
+                    out[written++] = static_cast<char>(((in[i] & 0x03) << 6) | (in[i + 1] & 0x3F));
+                    i += 2;
+                }
+                else {
+                    uint32_t codePoint;
+                    error = DecodeSequence(in + i, size - i, codePoint) != 0 ? "Character can't be represented in Latin-1" : "Invalid character";
+                    return written;
+                }
+            }
+            return written;
+        }
+
+        /*
+        * Upper halves (0x80..0xFF) of the supported single-byte code pages, their lower halves are ASCII.
+        * Bytes a code page leaves undefined map to the C1 control with the same value, as browsers do,
+        * so every byte has a character and every table can be reversed
+        */
+        constexpr char16_t windows1251[128] = {
+            0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021, 0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+            0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x0098, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+            0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7, 0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+            0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7, 0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+            0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+            0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427, 0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+            0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+            0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447, 0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,
+        };
+
+        constexpr char16_t windows1252[128] = {
+            0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+            0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+            0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7, 0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+            0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7, 0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+            0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7, 0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+            0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7, 0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+            0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7, 0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+            0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7, 0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+        };
+
+        constexpr char16_t koi8r[128] = {
+            0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518, 0x251C, 0x2524, 0x252C, 0x2534, 0x253C, 0x2580, 0x2584, 0x2588, 0x258C, 0x2590,
+            0x2591, 0x2592, 0x2593, 0x2320, 0x25A0, 0x2219, 0x221A, 0x2248, 0x2264, 0x2265, 0x00A0, 0x2321, 0x00B0, 0x00B2, 0x00B7, 0x00F7,
+            0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556, 0x2557, 0x2558, 0x2559, 0x255A, 0x255B, 0x255C, 0x255D, 0x255E,
+            0x255F, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565, 0x2566, 0x2567, 0x2568, 0x2569, 0x256A, 0x256B, 0x256C, 0x00A9,
+            0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433, 0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,
+            0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432, 0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,
+            0x042E, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413, 0x0425, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E,
+            0x041F, 0x042F, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412, 0x042C, 0x042B, 0x0417, 0x0428, 0x042D, 0x0429, 0x0427, 0x042A,
+        };
+
+        /*
+        * The way back, two table accesses per character: the upper byte of the code point picks
+        * a page of 256 bytes, the lower byte the code page byte in it. Zero means the code page
+        * doesn't have the character; page 0 is all zeros and stands for every unused upper byte.
+        * The upper halves use 6 pages at most, so a table takes a little over 2 KB
+        */
+        constexpr size_t maxReversePages = 8;
+
+        struct ReverseTable
+        {
+            std::array<unsigned char, 256> pageOf;
+            std::array<std::array<unsigned char, 256>, maxReversePages> pages;
+        };
+
+        constexpr ReverseTable MakeReverseTable(const char16_t (&table)[128]) {
+            ReverseTable reverse{};
+            size_t pageCount = 1;
+            for (size_t i = 0; i < 128; ++i) {
+                const size_t upper = table[i] >> 8;
+                if (reverse.pageOf[upper] == 0) {
+                    // Doesn't compile if a code page needs more pages
+                    if (pageCount == maxReversePages) {
+                        throw std::logic_error("Too many reverse table pages");
+                    }
+                    reverse.pageOf[upper] = static_cast<unsigned char>(pageCount++);
+                }
+                reverse.pages[reverse.pageOf[upper]][table[i] & 0xFF] = static_cast<unsigned char>(0x80 + i);
+            }
+            return reverse;
+        }
+
+        constexpr ReverseTable windows1251Reverse = MakeReverseTable(windows1251);
+        constexpr ReverseTable windows1252Reverse = MakeReverseTable(windows1252);
+        constexpr ReverseTable koi8rReverse = MakeReverseTable(koi8r);
+
+        const char16_t* ToUnicodeTable(CodePage codePage) {
+            switch (codePage) {
+            case CodePage::Windows1251:
+                return windows1251;
+            case CodePage::Windows1252:
+                return windows1252;
+            case CodePage::KOI8R:
+                return koi8r;
+            }
+            throw std::invalid_argument("Unknown code page");
+        }
+
+        const ReverseTable& FromUnicodeTable(CodePage codePage) {
+            switch (codePage) {
+            case CodePage::Windows1251:
+                return windows1251Reverse;
+            case CodePage::Windows1252:
+                return windows1252Reverse;
+            case CodePage::KOI8R:
+                return koi8rReverse;
+            }
+            throw std::invalid_argument("Unknown code page");
+        }
+
+        // Byte for a non-ASCII "codePoint", or -1 if the code page doesn't have it
+        inline int ReverseLookup(const ReverseTable& table, uint32_t codePoint) {
+            if (codePoint > 0xFFFF) {
+                return -1;
+            }
+            const unsigned char byte = table.pages[table.pageOf[codePoint >> 8]][codePoint & 0xFF];
+            return byte != 0 ? byte : -1;
+        }
+
+        /*
+        * Code page kernels. ASCII runs go through the SIMD helpers, every other byte is one lookup
+        * into a 128-entry table that stays in L1. All of the upper halves are in the BMP,
+        * so a byte gives at most 3 bytes of UTF-8.
+        * The upper halves aren't shuffled with pshufb: it looks up 16 entries at a time, so a 128-entry
+        * table takes 8 shuffles, compares and blends per 16 bytes, for each byte of the 16-bit result,
+        * and then the 2 and 3-byte sequences still have to be put together; that's no cheaper than
+        * one load per byte from L1
+        */
+        size_t EncodeCodePageToUTF8(const unsigned char* in, size_t size, const char16_t* table, char8_t* out) {
+            size_t written = 0;
+            for (size_t i = 0; i < size; ) {
+                const size_t ascii = ASCIIPrefixLength(in + i, size - i);
+                std::memcpy(out + written, in + i, ascii);
+                written += ascii;
+                i += ascii;
+                for (; i < size && in[i] >= 0x80; ++i) {
+                    const uint32_t codePoint = table[in[i] - 0x80];
+                    if (codePoint <= 0x07FF) {
+                        out[written++] = static_cast<char8_t>((codePoint >> 6) | 0xC0);
+                        out[written++] = static_cast<char8_t>((codePoint & 0x3F) | 0x80);
+                    }
+                    else {
+                        out[written++] = static_cast<char8_t>((codePoint >> 12) | 0xE0);
+                        out[written++] = static_cast<char8_t>(((codePoint >> 6) & 0x3F) | 0x80);
+                        out[written++] = static_cast<char8_t>((codePoint & 0x3F) | 0x80);
+                    }
+                }
+            }
+            return written;
+        }
+
+        void WidenCodePage(const unsigned char* in, size_t size, const char16_t* table, wchar_t* out) {
+            for (size_t i = 0; i < size; ) {
+                i += WidenASCII(in + i, size - i, out + i);
+                for (; i < size && in[i] >= 0x80; ++i) {
+                    out[i] = static_cast<wchar_t>(table[in[i] - 0x80]);
+                }
+            }
+        }
+
+        size_t DecodeUTF8ToCodePage(const char8_t* in, size_t size, const ReverseTable& table, char* out, const char*& error) {
+            size_t written = 0;
+            for (size_t i = 0; i < size; ) {
+                const size_t ascii = ASCIIPrefixLength(in + i, size - i);
+                std::memcpy(out + written, in + i, ascii);
+                written += ascii;
+                i += ascii;
+                while (i < size && in[i] >= 0x80) {
+                    uint32_t codePoint;
+                    const size_t length = DecodeSequence(in + i, size - i, codePoint);
+                    if (length == 0) {
+                        error = "Invalid character";
+                        return written;
+                    }
+                    const int byte = ReverseLookup(table, codePoint);
+                    if (byte < 0) {
+                        error = "Character can't be represented in the code page";
+                        return written;
+                    }
+                    out[written++] = static_cast<char>(byte);
+                    i += length;
+                }
+            }
+            return written;
+        }
+
+        size_t NarrowToCodePage(const wchar_t* in, size_t size, const ReverseTable& table, char* out, const char*& error) {
+            for (size_t i = 0; i < size; ) {
+                i += NarrowASCII(in + i, size - i, out + i);
+                for (; i < size && static_cast<uint32_t>(in[i]) >= 0x80; ++i) {
+                    // A surrogate never matches, supplementary characters aren't in any of the code pages
+                    const int byte = ReverseLookup(table, static_cast<uint32_t>(in[i]));
+                    if (byte < 0) {
+                        error = "Character can't be represented in the code page";
+                        return i;
+                    }
+                    out[i] = static_cast<char>(byte);
+                }
+            }
+            return size;
+        }
+
+        // Decodes the code point at the start of "in", returns the number of units it takes or zero if it isn't valid
+        size_t DecodeWideSequence(const wchar_t* in, size_t size, uint32_t& codePoint) {
+            codePoint = static_cast<uint32_t>(in[0]);
+#ifdef WideCharIsUTF16
+            if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+                if (codePoint > 0xDBFF || size < 2 || static_cast<uint32_t>(in[1]) < 0xDC00 || static_cast<uint32_t>(in[1]) > 0xDFFF) {
+                    return 0;
+                }
+                codePoint = ((codePoint - 0xD800) << 10) + (static_cast<uint32_t>(in[1]) - 0xDC00) + 0x10000;
+                return 2;
+            }
+#else
+            static_cast<void>(size);
+            if (codePoint > 0x10FFFF) {
+                return 0;
+            }
+#endif
+            return 1;
+        }
+
+        /*
+        * Compares the code points of both strings in lockstep and stops at the first difference.
+        * ASCII runs are widened a block at a time and compared with the wide units directly,
+        * every other code point is decoded on both sides
+        */
+        int CompareCodePoints(const std::u8string_view lhs, const std::wstring_view rhs, const char*& error) {
+            constexpr size_t block = 16;
+            wchar_t widened[block];
+            size_t i = 0;
+            size_t j = 0;
+            while (i < lhs.size() && j < rhs.size()) {
+                const size_t ascii = WidenASCII(lhs.data() + i, std::min({ block, lhs.size() - i, rhs.size() - j }), widened);
+                if (ascii != 0) {
+                    const auto [left, right] = std::mismatch(widened, widened + ascii, rhs.data() + j);
+                    if (left != widened + ascii) {
+                        // Any unit that isn't ASCII belongs to a larger code point
+                        return static_cast<uint32_t>(*left) < static_cast<uint32_t>(*right) ? -1 : 1;
+                    }
+                    i += ascii;
+                    j += ascii;
+                    continue;
+                }
+                uint32_t left;
+                uint32_t right;
+                const size_t leftLength = DecodeSequence(lhs.data() + i, lhs.size() - i, left);
+                const size_t rightLength = DecodeWideSequence(rhs.data() + j, rhs.size() - j, right);
+                if (leftLength == 0 || rightLength == 0) {
+                    error = leftLength == 0 ? "Invalid character" : "Invalid wide character";
+                    return 0;
+                }
+                if (left != right) {
+                    return left < right ? -1 : 1;
+                }
+                i += leftLength;
+                j += rightLength;
+            }
+            return (i < lhs.size()) - (j < rhs.size());
+        }
+
+        /*
+        * Streaming 64-bit hash of UTF-8 bytes, built from the xxHash64 round and avalanche.
+        * Bytes are consumed as 8-byte words, the words split between calls to Update are put together
+        * in "pending", so the value doesn't depend on how the bytes are fed in. Values are for hash tables
+        * within one process, they may differ between platforms
+        */
+        class UTF8Hasher
+        {
+        public:
+            void Update(const char8_t* in, size_t size) {
+                length += size;
+                if (pendingSize != 0) {
+                    const size_t taken = std::min(size, sizeof(pending) - pendingSize);
+                    std::memcpy(pending + pendingSize, in, taken);
+                    pendingSize += taken;
+                    in += taken;
+                    size -= taken;
+                    if (pendingSize < sizeof(pending)) {
+                        return;
+                    }
+                    Round(LoadWord(pending));
+                    pendingSize = 0;
+                }
+                for (; size >= 8; in += 8, size -= 8) {
+                    Round(LoadWord(in));
+                }
+                std::memcpy(pending, in, size);
+                pendingSize = size;
+            }
+
+            uint64_t Finish() const {
+                uint64_t tail = length;
+                for (size_t i = 0; i < pendingSize; ++i) {
+                    tail |= static_cast<uint64_t>(pending[i]) << (56 - i * 8);
+                }
+                uint64_t hash = state ^ (std::rotl(tail * prime2, 31) * prime1);
+                hash ^= hash >> 33;
+                hash *= prime2;
+                hash ^= hash >> 29;
+                hash *= prime3;
+                hash ^= hash >> 32;
+                return hash;
+            }
+
+        private:
+            static constexpr uint64_t prime1 = 0x9E3779B185EBCA87;
+            static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4F;
+            static constexpr uint64_t prime3 = 0x165667B19E3779F9;
+
+            void Round(uint64_t word) {
+                state = std::rotl(state + word * prime2, 31) * prime1;
+            }
+
+            uint64_t state = prime3;
+            uint64_t length = 0;
+            char8_t pending[8];
+            size_t pendingSize = 0;
+        };
+
+        /*
+        * Finds "needle" in "haystack" from "pos" on. With SSE2, 16 candidate positions are tested at once
+        * against the needle's first and last byte, and only the positions where both match are compared in full.
+        * No boundary check is needed: a valid needle starts with a lead byte and ends with a whole sequence,
+        * so in valid UTF-8 a match can only start and end on code point boundaries
+        */
+        size_t FindBytes(const std::u8string_view haystack, const std::u8string_view needle, size_t pos) {
+            if (needle.empty() || pos >= haystack.size()) {
+                return haystack.find(needle, pos);
+            }
+            size_t i = pos;
+#ifdef CharConvertersSSE2
+            const size_t last = needle.size() - 1;
+            const __m128i firstByte = _mm_set1_epi8(static_cast<char>(needle.front()));
+            const __m128i lastByte = _mm_set1_epi8(static_cast<char>(needle.back()));
+            for (; i + last + 16 <= haystack.size(); i += 16) {
+                const __m128i firstMatch = _mm_cmpeq_epi8(Load128(haystack.data() + i), firstByte);
+                const __m128i lastMatch = _mm_cmpeq_epi8(Load128(haystack.data() + i + last), lastByte);
+                unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(firstMatch, lastMatch)));
+                while (mask != 0) {
+                    const size_t candidate = i + std::countr_zero(mask);
+                    if (std::memcmp(haystack.data() + candidate + 1, needle.data() + 1, last) == 0) {
+                        return candidate;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+#endif
+            return haystack.find(needle, i);
+        }
+    }
+
+    namespace detail
+    {
+        const char8_t* DecodeCodePoint(const char8_t* it, const char8_t* end, char32_t& codePoint) {
+            uint32_t state = utf8Accept;
+            uint32_t decoded = 0;
+            do {
+                decoded = DecodeStep(state, decoded, *it++);
+            } while (state != utf8Accept && state != utf8Reject && it != end);
+            if (state != utf8Accept) {
+                throw std::invalid_argument("Invalid character");
+            }
+            codePoint = static_cast<char32_t>(decoded);
+            return it;
+        }
+
+        std::size_t EncodeUTF8Chunk(std::wstring_view& in, char8_t (&out)[chunkUnits * 4]) {
+            // TruncateWide keeps a surrogate pair together, the high surrogate goes to the next chunk
+            const size_t size = TruncateWide(in, chunkUnits).size();
+            const char* error = nullptr;
+            const size_t written = EncodeUTF8(in.data(), size, out, error);
+            if (error) {
+                throw std::invalid_argument(error);
+            }
+            in.remove_prefix(size);
+            return written;
+        }
+
+        std::size_t DecodeUTF8Chunk(std::u8string_view& in, wchar_t (&out)[chunkUnits + 1]) {
+            const size_t size = CodePointPrefix(in, chunkUnits);
+            const char* error = nullptr;
+            const size_t written = DecodeUTF8(in.data(), size, out, chunkUnits + 1, error);
+            if (error) {
+                throw std::invalid_argument(error);
+            }
+            in.remove_prefix(size);
+            return written;
+        }
+    }
+
+    std::size_t DecodeUTF8Block(std::u8string_view& in, std::span<char32_t> out) {
+        if (in.empty() || out.empty()) {
+            return 0;
+        }
+        // A byte gives at most one code point, so "out.size()" bytes always fit
+        const size_t size = CodePointPrefix(in, out.size());
+        const char* error = nullptr;
+        const size_t written = DecodeUTF8(in.data(), size, out.data(), out.size(), error);
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        in.remove_prefix(size);
+        return written;
+    }
+
+    std::u8string WideStrToUTF8(const std::wstring_view in) {
+        std::u8string out;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, MaxUTF8Units(in.size()), [&](char8_t* data) {
+            return EncodeUTF8(in.data(), in.size(), data, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::size_t UTF32ToUTF8InPlace(std::span<std::byte> buffer, std::size_t codePoints) {
+        if (codePoints > buffer.size() / sizeof(char32_t)) {
+            throw std::invalid_argument("Buffer is too small for the UTF-32 string");
+        }
+        const char* error = nullptr;
+        const size_t written = EncodeUTF32InPlace(reinterpret_cast<unsigned char*>(buffer.data()), codePoints, error);
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return written;
+    }
+
+    std::size_t UTF8ToUTF16InPlace(std::span<std::byte> buffer, std::size_t utf8Bytes) {
+        if (utf8Bytes > buffer.size() / 2) {
+            throw std::invalid_argument("Buffer is too small to expand the UTF-8 string in place");
+        }
+        unsigned char* data = reinterpret_cast<unsigned char*>(buffer.data());
+        const char* error = nullptr;
+        const size_t written = DecodeUTF8ToUTF16InPlace(data, data + buffer.size() - utf8Bytes, utf8Bytes, error);
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return written;
+    }
+
+    std::u8string Latin1ToUTF8(const std::string_view in) {
+        std::u8string out;
+        // Every byte gives one or two bytes
+        ResizeAndOverwrite(out, in.size() * 2, [&](char8_t* data) {
+            return EncodeLatin1ToUTF8(reinterpret_cast<const unsigned char*>(in.data()), in.size(), data);
+        });
+        return out;
+    }
+
+    std::string UTF8ToLatin1(const std::u8string_view in) {
+        std::string out;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, in.size(), [&](char* data) {
+            return DecodeUTF8ToLatin1(in.data(), in.size(), data, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::wstring Latin1ToWideStr(const std::string_view in) {
+        std::wstring out;
+        ResizeAndOverwrite(out, in.size(), [&](wchar_t* data) {
+            WidenBytes(reinterpret_cast<const unsigned char*>(in.data()), in.size(), data);
+            return in.size();
+        });
+        return out;
+    }
+
+    std::u8string CodePageToUTF8(const std::string_view in, CodePage codePage) {
+        const char16_t* table = ToUnicodeTable(codePage);
+        std::u8string out;
+        ResizeAndOverwrite(out, in.size() * 3, [&](char8_t* data) {
+            return EncodeCodePageToUTF8(reinterpret_cast<const unsigned char*>(in.data()), in.size(), table, data);
+        });
+        return out;
+    }
+
+    std::string UTF8ToCodePage(const std::u8string_view in, CodePage codePage) {
+        const ReverseTable& table = FromUnicodeTable(codePage);
+        std::string out;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, in.size(), [&](char* data) {
+            return DecodeUTF8ToCodePage(in.data(), in.size(), table, data, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::wstring CodePageToWideStr(const std::string_view in, CodePage codePage) {
+        const char16_t* table = ToUnicodeTable(codePage);
+        std::wstring out;
+        ResizeAndOverwrite(out, in.size(), [&](wchar_t* data) {
+            WidenCodePage(reinterpret_cast<const unsigned char*>(in.data()), in.size(), table, data);
+            return in.size();
+        });
+        return out;
+    }
+
+    std::string WideStrToCodePage(const std::wstring_view in, CodePage codePage) {
+        const ReverseTable& table = FromUnicodeTable(codePage);
+        std::string out;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, in.size(), [&](char* data) {
+            return NarrowToCodePage(in.data(), in.size(), table, data, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::u8string WideStrToUTF8(const wchar_t* in) {
+        return WideStrToUTF8(std::wstring_view(in));
+    }
+
+    std::u8string WideStrToUTF8(std::wstring&& in) {
+        std::u8string out;
+#ifdef WideCharIsUTF32
+        // Convert inside the input's own allocation, then copy out only the exact result
+        const char* error = nullptr;
+        unsigned char* buffer = reinterpret_cast<unsigned char*>(in.data());
+        const size_t size = EncodeUTF32InPlace(buffer, in.size(), error);
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        ResizeAndOverwrite(out, size, [&](char8_t* data) {
+            std::memcpy(data, buffer, size);
+            return size;
+        });
+#else
+        // UTF-16 grows in place (3 bytes for a 2-byte unit), so only allocate the exact size
+        AppendUTF8(out, in);
+#endif
+        // The input isn't needed anymore, give its memory back before the caller gets the result
+        std::wstring().swap(in);
+        return out;
+    }
+
+    std::wstring UTF8ToWideStrPadded(const std::u8string_view in) {
+        std::wstring out;
+        const char* error = nullptr;
+        const size_t capacity = MaxWideUnits(in.size()) + inputPadding;
+        ResizeAndOverwrite(out, capacity, [&](wchar_t* data) {
+            return DecodeUTF8<wchar_t, true>(in.data(), in.size(), data, capacity, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::wstring UTF8ToWideStr(const std::u8string_view in) {
+        std::wstring out;
+        const char* error = nullptr;
+        const size_t capacity = MaxWideUnits(in.size());
+        ResizeAndOverwrite(out, capacity, [&](wchar_t* data) {
+            return DecodeUTF8(in.data(), in.size(), data, capacity, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::u8string_view TruncateUTF8(const std::u8string_view in, size_t maxBytes) {
+        if (maxBytes >= in.size()) {
+            return in;
+        }
+        // A sequence is at most 4 bytes long, so the cut never moves back more than 3 of them
+        size_t size = maxBytes;
+        while (size > 0 && maxBytes - size < 3 && (in[size] & 0xC0) == 0x80) {
+            --size;
+        }
+        return in.substr(0, size);
+    }
+
+    std::wstring_view TruncateWide(const std::wstring_view in, size_t maxUnits) {
+        if (maxUnits >= in.size()) {
+            return in;
+        }
+        size_t size = maxUnits;
+#ifdef WideCharIsUTF16
+        if (size > 0 && in[size - 1] >= 0xD800 && in[size - 1] <= 0xDBFF && in[size] >= 0xDC00 && in[size] <= 0xDFFF) {
+            --size;
+        }
+#endif
+        return in.substr(0, size);
+    }
+
+    std::u8string WideStrToUTF8Truncated(const std::wstring_view in, size_t maxBytes) {
+        size_t bytes;
+        const size_t size = UTF8Prefix(in.data(), in.size(), maxBytes, bytes);
+        std::u8string out;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, bytes, [&](char8_t* data) {
+            return EncodeUTF8(in.data(), size, data, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::wstring UTF8ToWideStrTruncated(const std::u8string_view in, size_t maxUnits) {
+        size_t units;
+        const size_t size = WidePrefix<wchar_t>(in.data(), in.size(), maxUnits, units);
+        std::wstring out;
+        const char* error = nullptr;
+        const size_t capacity = MaxWideUnits(size);
+        ResizeAndOverwrite(out, capacity, [&](wchar_t* data) {
+            return DecodeUTF8(in.data(), size, data, capacity, error);
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    std::u8string_view UTF8SliceByUTF16(const std::u8string_view in, size_t utf16Begin, size_t utf16End) {
+        if (utf16Begin > utf16End) {
+            throw std::out_of_range("UTF-16 range is reversed");
+        }
+        size_t beginUnits;
+        const size_t begin = WidePrefix<char16_t>(in.data(), in.size(), utf16Begin, beginUnits);
+        // "beginUnits" is below "utf16Begin" if the range starts inside a surrogate pair
+        size_t sliceUnits;
+        const size_t size = WidePrefix<char16_t>(in.data() + begin, in.size() - begin, utf16End - beginUnits, sliceUnits);
+        if (begin + size == in.size() && beginUnits + sliceUnits < utf16End) {
+            throw std::out_of_range("UTF-16 range is past the end of the text");
+        }
+        return in.substr(begin, size);
+    }
+
+    std::wstring UTF8ToWideStrRange(const std::u8string_view in, size_t utf16Begin, size_t utf16End) {
+        return UTF8ToWideStr(UTF8SliceByUTF16(in, utf16Begin, utf16End));
+    }
+
+    void ApplyUTF8Edit(std::wstring& wide, const std::u8string_view newText, size_t editOffset, size_t insertedBytes) {
+        if (editOffset > newText.size() || insertedBytes > newText.size() - editOffset) {
+            throw std::out_of_range("Edit is past the end of the text");
+        }
+        /*
+        * Extend the edit to whole code points: back to the lead of the code point before it,
+        * so a sequence cut by the edit is decoded again, and forward to a boundary after it.
+        * TruncateUTF8 moves a cut back by at most 3 bytes, so cutting 3 bytes past the edit never ends inside it
+        */
+        const size_t begin = editOffset > 0 ? TruncateUTF8(newText, editOffset - 1).size() : 0;
+        const size_t end = TruncateUTF8(newText, editOffset + insertedBytes + 3).size();
+
+        const size_t prefixUnits = WideLength<wchar_t>(newText.data(), begin);
+        const size_t suffixUnits = WideLength<wchar_t>(newText.data() + end, newText.size() - end);
+        if (prefixUnits + suffixUnits > wide.size()) {
+            throw std::invalid_argument("Edit doesn't match the wide string");
+        }
+        // Converted before touching "wide", so it stays as it was if the new text is invalid
+        const std::wstring region = UTF8ToWideStr(newText.substr(begin, end - begin));
+        wide.replace(prefixUnits, wide.size() - prefixUnits - suffixUnits, region);
+    }
+
+    bool Equal(const std::u8string_view lhs, const std::wstring_view rhs) {
+        return Compare(lhs, rhs) == 0;
+    }
+
+    int Compare(const std::u8string_view lhs, const std::wstring_view rhs) {
+        const char* error = nullptr;
+        const int result = CompareCodePoints(lhs, rhs, error);
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return result;
+    }
+
+    uint64_t HashBytes(const std::u8string_view in) {
+        UTF8Hasher hasher;
+        hasher.Update(in.data(), in.size());
+        return hasher.Finish();
+    }
+
+    uint64_t HashCodePoints(const std::u8string_view in) {
+        return HashBytes(in);
+    }
+
+    uint64_t HashCodePoints(std::wstring_view in) {
+        // The wide string is hashed through its UTF-8 form, a stack chunk at a time
+        UTF8Hasher hasher;
+        char8_t buffer[detail::chunkUnits * 4];
+        while (!in.empty()) {
+            hasher.Update(buffer, detail::EncodeUTF8Chunk(in, buffer));
+        }
+        return hasher.Finish();
+    }
+
+    HashedUTF8 WideStrToUTF8Hashed(const std::wstring_view in) {
+        HashedUTF8 out;
+        UTF8Hasher hasher;
+        const char* error = nullptr;
+        ResizeAndOverwrite(out.text, MaxUTF8Units(in.size()), [&](char8_t* data) {
+            // Every chunk is hashed right after it's written, while it's still in L1
+            size_t written = 0;
+            for (size_t i = 0; i < in.size() && !error; ) {
+                // Chunks are cut the same way as in detail::EncodeUTF8Chunk
+                const size_t size = TruncateWide(in.substr(i), detail::chunkUnits).size();
+                const size_t chunk = EncodeUTF8(in.data() + i, size, data + written, error);
+                hasher.Update(data + written, chunk);
+                written += chunk;
+                i += size;
+            }
+            return written;
+        });
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        out.hash = hasher.Finish();
+        return out;
+    }
+
+    size_t FindInUTF8(const std::u8string_view haystack, const std::wstring_view needle, size_t pos) {
+        return FindBytes(haystack, WideStrToUTF8(needle), pos);
+    }
+
+    size_t CountCodePoints(const std::u8string_view in) {
+        return WideLength<char32_t>(in.data(), in.size());
+    }
+
+    size_t UTF16Length(const std::u8string_view in) {
+        return WideLength<char16_t>(in.data(), in.size());
+    }
+
+    size_t UTF8Length(const std::wstring_view in) {
+        return UTF8Length(in.data(), in.size());
+    }
+
+    void AppendUTF8(std::u8string& out, const std::wstring_view in) {
+        const size_t oldSize = out.size();
+        const char* error = nullptr;
+        ResizeAndOverwrite(out, oldSize + UTF8Length(in.data(), in.size()), [&](char8_t* data) {
+            return oldSize + EncodeUTF8(in.data(), in.size(), data + oldSize, error);
+        });
+        if (error) {
+            out.resize(oldSize);
+            throw std::invalid_argument(error);
+        }
+    }
+
+    void AppendWideStr(std::wstring& out, const std::u8string_view in) {
+        const size_t oldSize = out.size();
+        const char* error = nullptr;
+        // One unit on top for the store DecodeUTF8 makes past the last character
+        const size_t capacity = WideLength<wchar_t>(in.data(), in.size()) + 1;
+        ResizeAndOverwrite(out, oldSize + capacity, [&](wchar_t* data) {
+            return oldSize + DecodeUTF8(in.data(), in.size(), data + oldSize, capacity, error);
+        });
+        if (error) {
+            out.resize(oldSize);
+            throw std::invalid_argument(error);
+        }
+    }
+
+    InlineWideString::InlineWideString(const InlineWideString& other) {
+        *this = other;
+    }
+
+    InlineWideString::InlineWideString(InlineWideString&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    InlineWideString& InlineWideString::operator=(const InlineWideString& other) {
+        if (this != &other) {
+            wchar_t* dst = other.length <= inlineCapacity ? buffer : Allocate(other.length);
+            std::copy_n(other.data(), other.length, dst);
+            if (dst == buffer) {
+                heap.reset();
+            }
+            length = other.length;
+        }
+        return *this;
+    }
+
+    InlineWideString& InlineWideString::operator=(InlineWideString&& other) noexcept {
+        if (this != &other) {
+            if (other.heap) {
+                heap = std::move(other.heap);
+            }
+            else {
+                heap.reset();
+                std::copy_n(other.buffer, other.length, buffer);
+            }
+            length = other.length;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    wchar_t* InlineWideString::Allocate(std::size_t capacity) {
+        heap = std::make_unique_for_overwrite<wchar_t[]>(capacity);
+        return heap.get();
+    }
+
+    InlineWideString UTF8ToWideStrInline(const std::u8string_view in) {
+        InlineWideString out;
+        const char* error = nullptr;
+        if (MaxWideUnits(in.size()) <= InlineWideString::inlineCapacity) {
+            out.length = DecodeShortUTF8(in.data(), in.size(), out.buffer, InlineWideString::inlineCapacity, error);
+        }
+        else {
+            const size_t capacity = MaxWideUnits(in.size());
+            out.length = DecodeUTF8(in.data(), in.size(), out.Allocate(capacity), capacity, error);
+        }
+        if (error) {
+            throw std::invalid_argument(error);
+        }
+        return out;
+    }
+
+    UTF8OffsetIndex::UTF8OffsetIndex(std::u8string_view text) : text(text) {
+        const size_t checkpoints = text.size() / checkpointBytes + 1;
+        unitsAt.reserve(checkpoints);
+        size_t units = 0;
+        for (size_t i = 0; i < checkpoints; ++i) {
+            unitsAt.push_back(units);
+            const size_t begin = i * checkpointBytes;
+            units += WideLength<char16_t>(text.data() + begin, std::min(checkpointBytes, text.size() - begin));
+        }
+        utf16Size = units;
+
+        checkpointFor.reserve(utf16Size / checkpointUnits + 1);
+        size_t checkpoint = 0;
+        for (size_t target = 0; target <= utf16Size; target += checkpointUnits) {
+            while (checkpoint + 1 < unitsAt.size() && unitsAt[checkpoint + 1] <= target) {
+                ++checkpoint;
+            }
+            checkpointFor.push_back(checkpoint);
+        }
+    }
+
+    size_t UTF8OffsetIndex::UTF16FromByte(size_t byteOffset) const {
+        if (byteOffset > text.size()) {
+            throw std::out_of_range("Byte offset is past the end of the text");
+        }
+        // Round down to the start of the code point
+        byteOffset = TruncateUTF8(text, byteOffset).size();
+        const size_t checkpoint = byteOffset / checkpointBytes;
+        const size_t begin = checkpoint * checkpointBytes;
+        return unitsAt[checkpoint] + WideLength<char16_t>(text.data() + begin, byteOffset - begin);
+    }
+
+    size_t UTF8OffsetIndex::ByteFromUTF16(size_t utf16Index) const {
+        if (utf16Index > utf16Size) {
+            throw std::out_of_range("UTF-16 index is past the end of the text");
+        }
+        const size_t checkpoint = checkpointFor[utf16Index / checkpointUnits];
+        return ScanToUTF16Index(text, checkpoint * checkpointBytes, unitsAt[checkpoint], utf16Index);
+    }
+}
@@ -1,12 +1,358 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cwchar>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <span>
 #include <string>
+#include <vector>
 
+// On Windows, wchar_t is 16 bits, while on Linux, it's 32 bits
+#if WCHAR_MAX > 0xFFFF
+#define WideCharIsUTF32
+#else
 #define WideCharIsUTF16
+#endif
 
 namespace CharConverters
 {
+    namespace detail
+    {
+        // Decodes the code point at "it" with the same DFA as UTF8ToWideStr and returns the position after it
+        const char8_t* DecodeCodePoint(const char8_t* it, const char8_t* end, char32_t& codePoint);
+
+        // Input units converted per step by the output iterator overloads, the output goes through a stack buffer
+        inline constexpr std::size_t chunkUnits = 256;
+
+        // Convert a prefix of "in" that fits into "out", remove it from "in" and return the number of units written
+        std::size_t EncodeUTF8Chunk(std::wstring_view& in, char8_t (&out)[chunkUnits * 4]);
+        std::size_t DecodeUTF8Chunk(std::u8string_view& in, wchar_t (&out)[chunkUnits + 1]);
+    }
+
     std::u8string WideStrToUTF8(const std::wstring_view in);
     std::wstring UTF8ToWideStr(const std::u8string_view in);
+
+    /*
+    * Padded input: the caller guarantees that inputPadding bytes after the end of "in" can be read,
+    * their values don't matter. The kernels then keep their full-width loads up to the end of the input
+    * instead of leaving the last bytes to the scalar code
+    */
+    inline constexpr std::size_t inputPadding = 32;
+
+    std::wstring UTF8ToWideStrPadded(const std::u8string_view in);
+
+    /*
+    * Takes over a string the caller doesn't need anymore. Where wchar_t is 32 bits, the conversion
+    * runs inside the input's allocation and only the exact result is allocated, elsewhere the result
+    * is allocated with its exact size. Either way "in" is left empty with its memory released,
+    * if the input is invalid its contents are unspecified
+    */
+    std::u8string WideStrToUTF8(std::wstring&& in);
+    // Keeps string literals unambiguous next to the std::wstring&& overload
+    std::u8string WideStrToUTF8(const wchar_t* in);
+
+    /*
+    * In-place conversions inside one caller-owned buffer, for when there is no room for two copies.
+    * The text is read and written through the buffer's bytes in the platform's byte order.
+    * If the input is invalid, std::invalid_argument is thrown and the buffer's contents are unspecified
+    */
+    // UTF-32 stored at the start of "buffer" becomes UTF-8 at the same address, returns its size in bytes
+    std::size_t UTF32ToUTF8InPlace(std::span<std::byte> buffer, std::size_t codePoints);
+    /*
+    * UTF-8 stored in the last "utf8Bytes" bytes of "buffer" becomes UTF-16 at its start,
+    * returns the number of UTF-16 units. The buffer must be at least 2 * utf8Bytes bytes
+    */
+    std::size_t UTF8ToUTF16InPlace(std::span<std::byte> buffer, std::size_t utf8Bytes);
+
+    /*
+    * Latin-1 (ISO-8859-1) converters without an intermediate wide string.
+    * UTF8ToLatin1 throws std::invalid_argument for characters above U+00FF
+    */
+    std::u8string Latin1ToUTF8(const std::string_view in);
+    std::string UTF8ToLatin1(const std::u8string_view in);
+    std::wstring Latin1ToWideStr(const std::string_view in);
+
+    // Single-byte code pages
+    enum class CodePage
+    {
+        Windows1251,
+        Windows1252,
+        KOI8R,
+    };
+
+    /*
+    * Converters for single-byte code pages, table driven.
+    * Converting to a code page throws std::invalid_argument for characters it doesn't have
+    */
+    std::u8string CodePageToUTF8(const std::string_view in, CodePage codePage);
+    std::string UTF8ToCodePage(const std::u8string_view in, CodePage codePage);
+    std::wstring CodePageToWideStr(const std::string_view in, CodePage codePage);
+    std::string WideStrToCodePage(const std::wstring_view in, CodePage codePage);
+
+    /*
+    * Compare a UTF-8 and a wide string by code points without converting either of them.
+    * Compare returns a negative value, zero or a positive value like std::wstring::compare.
+    * Both stop at the first difference; an invalid sequence before it throws std::invalid_argument
+    */
+    bool Equal(const std::u8string_view lhs, const std::wstring_view rhs);
+    int Compare(const std::u8string_view lhs, const std::wstring_view rhs);
+
+    /*
+    * Hash of the code points of a string, the same for its UTF-8 and its wide form.
+    * The wide overload validates like WideStrToUTF8 and throws std::invalid_argument for an invalid
+    * wide string, an unpaired surrogate included; the UTF-8 overload hashes the bytes as they are
+    */
+    std::uint64_t HashCodePoints(const std::u8string_view in);
+    std::uint64_t HashCodePoints(std::wstring_view in);
+
+    // Hash of UTF-8 bytes, the one HashCodePoints and WideStrToUTF8Hashed compute
+    std::uint64_t HashBytes(const std::u8string_view in);
+
+    struct HashedUTF8
+    {
+        std::u8string text;
+        std::uint64_t hash;
+    };
+
+    // Converts and hashes the output while it's written, so the hash costs no second pass over it
+    HashedUTF8 WideStrToUTF8Hashed(const std::wstring_view in);
+
+    // Transparent functors to look up UTF-8 keys with wide strings and the other way around
+    struct TextHash
+    {
+        using is_transparent = void;
+        std::size_t operator()(const std::u8string_view text) const { return static_cast<std::size_t>(HashCodePoints(text)); }
+        std::size_t operator()(const std::wstring_view text) const { return static_cast<std::size_t>(HashCodePoints(text)); }
+    };
+
+    struct TextEqual
+    {
+        using is_transparent = void;
+        bool operator()(const std::u8string_view lhs, const std::u8string_view rhs) const noexcept { return lhs == rhs; }
+        bool operator()(const std::wstring_view lhs, const std::wstring_view rhs) const noexcept { return lhs == rhs; }
+        bool operator()(const std::u8string_view lhs, const std::wstring_view rhs) const { return Equal(lhs, rhs); }
+        bool operator()(const std::wstring_view lhs, const std::u8string_view rhs) const { return Equal(rhs, lhs); }
+    };
+
+    /*
+    * Byte offset of the first occurrence of "needle" in "haystack" at or after byte "pos",
+    * or std::u8string_view::npos. Only the needle is converted
+    */
+    std::size_t FindInUTF8(const std::u8string_view haystack, const std::wstring_view needle, std::size_t pos = 0);
+
+    /*
+    * Lengths of the converted string without converting or allocating.
+    * The input isn't validated, the results are exact for valid input
+    */
+    std::size_t CountCodePoints(const std::u8string_view in);
+    std::size_t UTF16Length(const std::u8string_view in);
+    std::size_t UTF8Length(const std::wstring_view in);
+
+    /*
+    * Longest prefix of "in" not longer than the budget that doesn't split a code point,
+    * found by looking at most 3 bytes or 1 unit back from the cut
+    */
+    std::u8string_view TruncateUTF8(const std::u8string_view in, std::size_t maxBytes);
+    std::wstring_view TruncateWide(const std::wstring_view in, std::size_t maxUnits);
+
+    /*
+    * The part of "in" between two UTF-16 indexes, found by counting units without converting.
+    * Indexes inside a surrogate pair round down to the pair's start.
+    * Throws std::out_of_range for a reversed range or one past the end of the text
+    */
+    std::u8string_view UTF8SliceByUTF16(const std::u8string_view in, std::size_t utf16Begin, std::size_t utf16End);
+    std::wstring UTF8ToWideStrRange(const std::u8string_view in, std::size_t utf16Begin, std::size_t utf16End);
+
+    /*
+    * Updates "wide", the conversion of a UTF-8 text, after "insertedBytes" bytes at "editOffset" replaced
+    * some bytes of that text, with "newText" being the text after the edit. The unchanged prefix and suffix
+    * are only counted, so the removed length isn't needed; only the edited code points are converted.
+    * Throws std::invalid_argument if the edited code points are invalid, "wide" is left as it was then
+    */
+    void ApplyUTF8Edit(std::wstring& wide, const std::u8string_view newText, std::size_t editOffset, std::size_t insertedBytes);
+
+    // Convert as many whole code points as fit in the output budget and drop the rest
+    std::u8string WideStrToUTF8Truncated(const std::wstring_view in, std::size_t maxBytes);
+    std::wstring UTF8ToWideStrTruncated(const std::u8string_view in, std::size_t maxUnits);
+
+    // Append the converted string to "out", which grows once by the exact converted size
+    void AppendUTF8(std::u8string& out, const std::wstring_view in);
+    void AppendWideStr(std::wstring& out, const std::u8string_view in);
+
+    // Write the converted string to an output iterator and return the iterator past the last unit
+    template<std::output_iterator<char8_t> Out>
+    Out WideStrToUTF8(std::wstring_view in, Out out) {
+        char8_t buffer[detail::chunkUnits * 4];
+        while (!in.empty()) {
+            out = std::copy_n(buffer, detail::EncodeUTF8Chunk(in, buffer), out);
+        }
+        return out;
+    }
+
+    template<std::output_iterator<wchar_t> Out>
+    Out UTF8ToWideStr(std::u8string_view in, Out out) {
+        wchar_t buffer[detail::chunkUnits + 1];
+        while (!in.empty()) {
+            out = std::copy_n(buffer, detail::DecodeUTF8Chunk(in, buffer), out);
+        }
+        return out;
+    }
+
+    /*
+    * Wide string that keeps up to inlineCapacity code units inside the object itself.
+    * Only longer strings are moved to the heap.
+    */
+    class InlineWideString
+    {
+    public:
+        static constexpr std::size_t inlineCapacity = 64;
+
+        InlineWideString() noexcept = default;
+        InlineWideString(const InlineWideString& other);
+        InlineWideString(InlineWideString&& other) noexcept;
+        InlineWideString& operator=(const InlineWideString& other);
+        InlineWideString& operator=(InlineWideString&& other) noexcept;
+
+        const wchar_t* data() const noexcept { return heap ? heap.get() : buffer; }
+        std::size_t size() const noexcept { return length; }
+        bool empty() const noexcept { return length == 0; }
+        bool IsInline() const noexcept { return !heap; }
+
+        std::wstring_view view() const noexcept { return { data(), length }; }
+        operator std::wstring_view() const noexcept { return view(); }
+        std::wstring str() const { return std::wstring(view()); }
+
+    private:
+        friend InlineWideString UTF8ToWideStrInline(const std::u8string_view in);
+
+        wchar_t* Allocate(std::size_t capacity);
+
+        std::unique_ptr<wchar_t[]> heap;
+        std::size_t length = 0;
+        wchar_t buffer[inlineCapacity];
+    };
+
+    // Same as UTF8ToWideStr, but short results don't touch the heap
+    InlineWideString UTF8ToWideStrInline(const std::u8string_view in);
+
+
+    /*
+    * Lazy view over the code points of a UTF-8 string, nothing is allocated.
+    * Invalid input throws std::invalid_argument when the iterator reaches it
+    */
+    class DecodeUTF8View : public std::ranges::view_interface<DecodeUTF8View>
+    {
+    public:
+        class iterator
+        {
+        public:
+            using value_type = char32_t;
+            using difference_type = std::ptrdiff_t;
+            using iterator_concept = std::forward_iterator_tag;
+
+            iterator() = default;
+
+            char32_t operator*() const noexcept { return codePoint; }
+            iterator& operator++() {
+                position = next;
+                Decode();
+                return *this;
+            }
+            iterator operator++(int) {
+                iterator copy = *this;
+                ++*this;
+                return copy;
+            }
+            bool operator==(const iterator& other) const noexcept { return position == other.position; }
+            bool operator==(std::default_sentinel_t) const noexcept { return position == end; }
+
+            // Position of the current code point inside the UTF-8 string
+            const char8_t* base() const noexcept { return position; }
+
+        private:
+            friend DecodeUTF8View;
+
+            iterator(const char8_t* position, const char8_t* end) : position(position), next(position), end(end) {
+                Decode();
+            }
+
+            void Decode() {
+                if (position == end) {
+                    return;
+                }
+                if (*position < 0x80) {
+                    codePoint = *position;
+                    next = position + 1;
+                }
+                else {
+                    next = detail::DecodeCodePoint(position, end, codePoint);
+                }
+            }
+
+            const char8_t* position = nullptr;
+            const char8_t* next = nullptr;
+            const char8_t* end = nullptr;
+            char32_t codePoint = 0;
+        };
+
+        DecodeUTF8View() = default;
+        explicit DecodeUTF8View(const std::u8string_view text) : text(text) {}
+
+        iterator begin() const { return iterator(text.data(), text.data() + text.size()); }
+        std::default_sentinel_t end() const noexcept { return {}; }
+
+    private:
+        std::u8string_view text;
+    };
+
+    namespace views
+    {
+        inline DecodeUTF8View decode_utf8(const std::u8string_view text) {
+            return DecodeUTF8View(text);
+        }
+    }
+
+    /*
+    * Block decoding for consumers that want code points in a contiguous buffer:
+    * decodes as many whole code points as fit into "out", removes them from the front of "in"
+    * and returns how many were written
+    */
+    std::size_t DecodeUTF8Block(std::u8string_view& in, std::span<char32_t> out);
+
+    /*
+    * Translates positions between UTF-8 byte offsets and UTF-16 unit indexes of one text.
+    * It keeps the UTF-16 index of every 256th byte, and for every 256th UTF-16 index the checkpoint below it,
+    * so a lookup is one table access and a scan of a few hundred bytes at most.
+    * Positions inside a code point round down to its start; the text must outlive the index
+    */
+    class UTF8OffsetIndex
+    {
+    public:
+        static constexpr std::size_t checkpointBytes = 256;
+        static constexpr std::size_t checkpointUnits = 256;
+
+        explicit UTF8OffsetIndex(std::u8string_view text);
+
+        // Both throw std::out_of_range for positions past the end of the text
+        std::size_t UTF16FromByte(std::size_t byteOffset) const;
+        std::size_t ByteFromUTF16(std::size_t utf16Index) const;
+
+        std::size_t UTF16Size() const noexcept { return utf16Size; }
+
+    private:
+        std::u8string_view text;
+        std::size_t utf16Size;
+        // UTF-16 index of byte i * checkpointBytes
+        std::vector<std::size_t> unitsAt;
+        // Last byte checkpoint whose UTF-16 index is not above i * checkpointUnits
+        std::vector<std::size_t> checkpointFor;
+    };
 }
 
+// The iterators point into the viewed string, not into the view
+template<>
+inline constexpr bool std::ranges::enable_borrowed_range<CharConverters::DecodeUTF8View> = true;
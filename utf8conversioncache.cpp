@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <mutex>
+
+#include "utf8conversioncache.hpp"
+
+namespace CharConverters
+{
+    UTF8ConversionCache::UTF8ConversionCache(std::size_t capacity)
+        : capacity(std::max<std::size_t>(capacity, 1)) {
+    }
+
+    std::shared_ptr<const std::u8string> UTF8ConversionCache::WideStrToUTF8(const std::wstring_view in) {
+        const HashedKey key{ in, std::hash<std::wstring_view>{}(in) };
+        // The low bits pick the bucket inside the map, so use the high ones for the shard
+        Shard& shard = shards[(key.hash >> (sizeof(std::size_t) * 8 - 4)) % shardCount];
+        {
+            std::shared_lock lock(shard.mutex);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end()) {
+                return it->second;
+            }
+        }
+        // Convert outside of the lock, so a miss doesn't stall readers of the same shard
+        auto converted = std::make_shared<const std::u8string>(CharConverters::WideStrToUTF8(in));
+        std::unique_lock lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            // Another thread was faster, hand out its copy to keep results shared
+            return it->second;
+        }
+        /*
+        * First in, first out within the shard. A shard with nothing to evict inserts anyway,
+        * so the cache can go over its capacity by about one entry per shard
+        */
+        if (size.load(std::memory_order_relaxed) >= capacity && !shard.order.empty()) {
+            shard.entries.erase(shard.entries.find(shard.order.front()));
+            shard.order.pop_front();
+            size.fetch_sub(1, std::memory_order_relaxed);
+        }
+        const auto inserted = shard.entries.emplace(std::wstring(in), converted).first;
+        shard.order.push_back(HashedKey{ inserted->first, key.hash });
+        size.fetch_add(1, std::memory_order_relaxed);
+        return converted;
+    }
+
+    void UTF8ConversionCache::Clear() {
+        for (Shard& shard : shards) {
+            std::unique_lock lock(shard.mutex);
+            size.fetch_sub(shard.entries.size(), std::memory_order_relaxed);
+            shard.entries.clear();
+            shard.order.clear();
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "charconverters.hpp"
+
+namespace CharConverters
+{
+    /*
+    * Opt-in bounded cache for strings that are converted over and over again.
+    * Entries are spread over shards by the hash of the input, every shard has its own
+    * reader-writer lock, so concurrent lookups never wait on a global lock.
+    * Results are shared and immutable, a hit costs one hash and one map lookup.
+    * Once the cache holds "capacity" entries, a miss evicts the oldest entry of its shard.
+    */
+    class UTF8ConversionCache
+    {
+    public:
+        explicit UTF8ConversionCache(std::size_t capacity = 4096);
+
+        std::shared_ptr<const std::u8string> WideStrToUTF8(const std::wstring_view in);
+        void Clear();
+
+    private:
+        // Lookup key that carries an already computed hash, so it's calculated only once per call
+        struct HashedKey
+        {
+            std::wstring_view text;
+            std::size_t hash;
+        };
+
+        struct KeyHash
+        {
+            using is_transparent = void;
+            std::size_t operator()(const std::wstring& key) const noexcept { return std::hash<std::wstring_view>{}(key); }
+            std::size_t operator()(const HashedKey& key) const noexcept { return key.hash; }
+        };
+
+        struct KeyEqual
+        {
+            using is_transparent = void;
+            bool operator()(const std::wstring& lhs, const std::wstring& rhs) const noexcept { return lhs == rhs; }
+            bool operator()(const HashedKey& lhs, const std::wstring& rhs) const noexcept { return lhs.text == rhs; }
+            bool operator()(const std::wstring& lhs, const HashedKey& rhs) const noexcept { return lhs == rhs.text; }
+        };
+
+        struct Shard
+        {
+            std::shared_mutex mutex;
+            std::unordered_map<std::wstring, std::shared_ptr<const std::u8string>, KeyHash, KeyEqual> entries;
+            // Keys in insertion order, viewing the keys stored in "entries"
+            std::deque<HashedKey> order;
+        };
+
+        static constexpr std::size_t shardCount = 16;
+
+        std::array<Shard, shardCount> shards;
+        std::size_t capacity;
+        // Entries in all shards, so the whole capacity is used however unevenly the keys spread
+        std::atomic<std::size_t> size = 0;
+    };
+}